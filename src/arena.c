@@ -0,0 +1,155 @@
+//
+//  Arena allocator for the database
+//  OpenCMA
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opencma.h"
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGNMENT (2 * sizeof(void *))
+
+// blocks are chained through their first bytes
+struct arena_block
+{
+    struct arena_block *next;
+};
+
+#define ARENA_HEADER_SIZE ((sizeof(struct arena_block) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+static void *arenaBump(struct cma_arena *arena, size_t size, size_t align)
+{
+    struct arena_block *block;
+    size_t padding = (align - ((size_t)arena->next & (align - 1))) & (align - 1);
+    char *ptr;
+
+    if (arena->next == NULL || size + padding > (size_t)(arena->end - arena->next))
+    {
+        // anything too big for a block gets a block of its own
+        size_t block_size = size + ARENA_HEADER_SIZE > ARENA_BLOCK_SIZE ? size + ARENA_HEADER_SIZE : ARENA_BLOCK_SIZE;
+
+        if ((block = malloc(block_size)) == NULL)
+        {
+            LOG(LERROR, "Out of memory\n");
+            abort();
+        }
+
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->size += block_size;
+
+        if (block_size > ARENA_BLOCK_SIZE && arena->next != NULL)
+        {
+            // keep filling the current block after this
+            return (char *)block + ARENA_HEADER_SIZE;
+        }
+
+        arena->next = (char *)block + ARENA_HEADER_SIZE;
+        arena->end = (char *)block + block_size;
+        padding = 0;
+    }
+
+    ptr = arena->next + padding;
+    arena->next = ptr + size;
+    return ptr;
+}
+
+// memory from the arena is only given back by arenaRelease()
+void *arenaAlloc(struct cma_arena *arena, size_t size)
+{
+    return memset(arenaBump(arena, size, ARENA_ALIGNMENT), 0, size);
+}
+
+char *arenaStrdup(struct cma_arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    return memcpy(arenaBump(arena, len, 1), str, len);
+}
+
+char *arenaPrintf(struct cma_arena *arena, const char *format, ...)
+{
+    va_list args;
+    size_t space = arena->next != NULL ? arena->end - arena->next : 0;
+    int len;
+    char *str;
+
+    // try to print straight into the current block
+    va_start(args, format);
+    len = vsnprintf(arena->next, space, format, args);
+    va_end(args);
+
+    if (len < 0)
+    {
+        return NULL;
+    }
+
+    if ((size_t)len < space)
+    {
+        return arenaBump(arena, len + 1, 1);
+    }
+
+    str = arenaBump(arena, len + 1, 1);
+    va_start(args, format);
+    vsnprintf(str, len + 1, format, args);
+    va_end(args);
+    return str;
+}
+
+// frees everything that was allocated from the arena
+void arenaRelease(struct cma_arena *arena)
+{
+    struct arena_block *block;
+    struct arena_block *next;
+
+    for (block = arena->blocks; block != NULL; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+
+    arena->blocks = NULL;
+    arena->size = 0;
+    arena->next = NULL;
+    arena->end = NULL;
+}
+
+// fixed size objects are recycled through the slab, so removing and adding objects does not grow the arena
+void *slabAlloc(struct cma_arena *arena, struct cma_slab *slab)
+{
+    void *ptr = slab->free_list;
+
+    if (ptr == NULL)
+    {
+        return arenaAlloc(arena, slab->size);
+    }
+
+    slab->free_list = *(void **)ptr;
+    return memset(ptr, 0, slab->size);
+}
+
+void slabFree(struct cma_slab *slab, void *ptr)
+{
+    if (ptr != NULL)
+    {
+        *(void **)ptr = slab->free_list;
+        slab->free_list = ptr;
+    }
+}
@@ -19,595 +19,2567 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
-#include <dirent.h>
 #include <limits.h>
 #include <pthread.h>
-#include <sys/stat.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <vitamtp.h>
 
 #include "opencma.h"
 
+// the database the Vita sees, only replaced by publishDatabase()
 struct cma_database *g_database;
-int g_ohfi_count;
-pthread_mutexattr_t g_database_lock_attr;
-pthread_mutex_t g_database_lock;
-
-static inline void initDatabase(struct cma_paths *paths, const char *uuid)
-{
-    pthread_mutex_lock(&g_database_lock);
-    g_ohfi_count = OHFI_OFFSET;
-
-    g_database->photos.metadata.ohfi = VITA_OHFI_PHOTO;
-    g_database->photos.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->photos.metadata.dataType = Photo;
-    g_database->photos.path = strdup(paths->photosPath);
-    g_database->photos.num_filters = 2;
-    g_database->photos.filters = calloc(2, sizeof(metadata_t));
-    createFilter(&g_database->photos, &g_database->photos.filters[0], "Folders",
+// OHFIs are never reused, not even by a new database, so an old OHFI cannot turn into another object
+static int g_ohfi_count = OHFI_OFFSET;
+// the database this thread has locked or is building
+static __thread struct cma_database *g_current;
+static __thread int g_lock_depth;
+static __thread int g_building;
+// counters for getDatabaseStats(), kept across refreshes
+static unsigned long g_ohfi_lookups;
+static unsigned long g_path_lookups;
+static unsigned long g_name_lookups;
+static unsigned long g_name_probes;
+static unsigned long g_listings;
+static unsigned long g_cached_listings;
+
+// a serialized element and the size of the object when it was made
+struct cma_xml
+{
+    metadata_element_t element;
+    unsigned long size;
+};
+
+// the OHFI table is dense since OHFIs are handed out sequentially
+// old OHFI tables are left in the arena, so lookupOhfi() never reads a freed one
+static void registerObject(struct cma_database *db, int ohfi, struct cma_object *object)
+{
+    if (ohfi >= db->ohfi_table_size)
+    {
+        int size = db->ohfi_table_size ? db->ohfi_table_size : OHFI_OFFSET * 2;
+        struct cma_object **table;
+
+        while (size <= ohfi)
+        {
+            size *= 2;
+        }
+
+        table = arenaAlloc(&db->arena, size * sizeof(struct cma_object *));
+
+        if (db->ohfi_table_size > 0)
+        {
+            memcpy(table, db->ohfi_table, db->ohfi_table_size * sizeof(struct cma_object *));
+        }
+
+        db->xml_table = realloc(db->xml_table, size * sizeof(struct cma_xml *));
+        memset(&db->xml_table[db->ohfi_table_size], 0,
+               (size - db->ohfi_table_size) * sizeof(struct cma_xml *));
+        // the table before the size, so a reader never looks past the end
+        __atomic_store_n(&db->ohfi_table, table, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&db->ohfi_table_size, size, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_store_n(&db->ohfi_table[ohfi], object, __ATOMIC_SEQ_CST);
+}
+
+static void forgetElement(struct cma_database *db, int ohfi)
+{
+    struct cma_xml *xml = db->xml_table[ohfi];
+
+    if (xml != NULL)
+    {
+        free(xml->element.data);
+        free(xml);
+        db->xml_table[ohfi] = NULL;
+    }
+}
+
+static inline void unregisterObject(struct cma_database *db, int ohfi)
+{
+    if (ohfi < db->ohfi_table_size)
+    {
+        __atomic_store_n(&db->ohfi_table[ohfi], NULL, __ATOMIC_SEQ_CST);
+        forgetElement(db, ohfi);
+    }
+}
+
+// needs no lock, only a pin on the database
+static inline struct cma_object *lookupOhfi(struct cma_database *db, int ohfi)
+{
+    int size = __atomic_load_n(&db->ohfi_table_size, __ATOMIC_SEQ_CST);
+    struct cma_object **table = __atomic_load_n(&db->ohfi_table, __ATOMIC_SEQ_CST);
+
+    return ohfi > 0 && ohfi < size ? __atomic_load_n(&table[ohfi], __ATOMIC_SEQ_CST) : NULL;
+}
+
+static unsigned int nameHash(int ohfiParent, const char *name, size_t len)
+{
+    // FNV-1a seeded with the parent
+    unsigned int hash = 2166136261u ^ (unsigned int)ohfiParent;
+
+    while (len--)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static inline unsigned int objectNameHash(const struct cma_object *object)
+{
+    return nameHash(object->metadata.ohfiParent, object->metadata.name, strlen(object->metadata.name));
+}
+
+static void hashObject(struct cma_database *db, struct cma_object *object)
+{
+    unsigned int slot;
+
+    if (db->name_count >= db->name_table_size)
+    {
+        // grow the table and move everything over
+        int oldsize = db->name_table_size;
+        struct cma_object **oldtable = db->name_table;
+        struct cma_object *entry;
+        struct cma_object *next;
+
+        db->name_table_size = oldsize ? oldsize * 2 : 1024;
+        db->name_table = calloc(db->name_table_size, sizeof(struct cma_object *));
+
+        for (int i = 0; i < oldsize; i++)
+        {
+            for (entry = oldtable[i]; entry != NULL; entry = next)
+            {
+                next = entry->next_name;
+                slot = objectNameHash(entry) & (db->name_table_size - 1);
+                entry->next_name = db->name_table[slot];
+                db->name_table[slot] = entry;
+            }
+        }
+
+        free(oldtable);
+    }
+
+    slot = objectNameHash(object) & (db->name_table_size - 1);
+    object->next_name = db->name_table[slot];
+    db->name_table[slot] = object;
+    db->name_count++;
+}
+
+static void unhashObject(struct cma_database *db, struct cma_object *object)
+{
+    struct cma_object **p_entry;
+
+    if (db->name_table_size == 0)
+    {
+        return;
+    }
+
+    p_entry = &db->name_table[objectNameHash(object) & (db->name_table_size - 1)];
+
+    for (; *p_entry != NULL; p_entry = &(*p_entry)->next_name)
+    {
+        if (*p_entry == object)
+        {
+            *p_entry = object->next_name;
+            object->next_name = NULL;
+            db->name_count--;
+            break;
+        }
+    }
+}
+
+static struct cma_object *lookupName(struct cma_database *db, int ohfiParent, const char *name, size_t len)
+{
+    struct cma_object *entry;
+    unsigned long probes = 0;
+
+    if (db->name_table_size == 0)
+    {
+        return NULL;
+    }
+
+    entry = db->name_table[nameHash(ohfiParent, name, len) & (db->name_table_size - 1)];
+
+    for (; entry != NULL; entry = entry->next_name)
+    {
+        probes++;
+
+        if (entry->metadata.ohfiParent == ohfiParent && strncmp(entry->metadata.name, name, len) == 0
+                && entry->metadata.name[len] == '\0')
+        {
+            break;
+        }
+    }
+
+    __atomic_add_fetch(&g_name_lookups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_name_probes, probes, __ATOMIC_RELAXED);
+    return entry;
+}
+
+// the Vita sends the size and the first 0x400 bytes of what it is about to back up
+#define PRINT_BYTES 0x400
+
+// app, save and backup files, the only ones the Vita asks about
+static inline int isPrinted(const struct cma_object *object)
+{
+    return (object->metadata.dataType & File) && (object->metadata.dataType & (App | SaveData));
+}
+
+static inline unsigned int sizeHash(unsigned long size)
+{
+    return nameHash(0, (const char *)&size, sizeof(size));
+}
+
+static inline unsigned int contentHash(const char *data, size_t len)
+{
+    unsigned int hash = nameHash(0, data, len);
+    return hash ? hash : 1; // 0 is for files that have not been read
+}
+
+static void printObject(struct cma_database *db, struct cma_object *object)
+{
+    unsigned int slot;
+
+    if (db->print_count >= db->print_table_size)
+    {
+        // grow the table and move everything over
+        int oldsize = db->print_table_size;
+        struct cma_object **oldtable = db->print_table;
+        struct cma_object *entry;
+        struct cma_object *next;
+
+        db->print_table_size = oldsize ? oldsize * 2 : 256;
+        db->print_table = calloc(db->print_table_size, sizeof(struct cma_object *));
+
+        for (int i = 0; i < oldsize; i++)
+        {
+            for (entry = oldtable[i]; entry != NULL; entry = next)
+            {
+                next = entry->next_print;
+                slot = sizeHash(entry->metadata.size) & (db->print_table_size - 1);
+                entry->next_print = db->print_table[slot];
+                db->print_table[slot] = entry;
+            }
+        }
+
+        free(oldtable);
+    }
+
+    slot = sizeHash(object->metadata.size) & (db->print_table_size - 1);
+    object->next_print = db->print_table[slot];
+    db->print_table[slot] = object;
+    db->print_count++;
+}
+
+static void unprintObject(struct cma_database *db, struct cma_object *object)
+{
+    struct cma_object **p_entry;
+
+    if (db->print_table_size == 0)
+    {
+        return;
+    }
+
+    p_entry = &db->print_table[sizeHash(object->metadata.size) & (db->print_table_size - 1)];
+
+    for (; *p_entry != NULL; p_entry = &(*p_entry)->next_print)
+    {
+        if (*p_entry == object)
+        {
+            *p_entry = object->next_print;
+            object->next_print = NULL;
+            db->print_count--;
+            break;
+        }
+    }
+}
+
+// a file that was written to is filed under its new size and read again when it is asked about
+static void resizeObject(struct cma_database *db, struct cma_object *object, unsigned long size)
+{
+    pthread_mutex_lock(&db->table_lock);
+    unprintObject(db, object);
+    object->metadata.size = size;
+    object->print = 0;
+    printObject(db, object);
+    pthread_mutex_unlock(&db->table_lock);
+}
+
+// names repeat a lot (sce_sys, ICON0.PNG, ...) so each distinct string is stored once, the result must not be modified
+static char *internName(struct cma_database *db, const char *name)
+{
+    size_t len = strlen(name);
+    unsigned int slot;
+
+    if (db->intern_count * 2 >= db->intern_table_size)
+    {
+        // grow the table and move everything over
+        int oldsize = db->intern_table_size;
+        char **oldtable = db->intern_table;
+
+        db->intern_table_size = oldsize ? oldsize * 2 : 1024;
+        db->intern_table = calloc(db->intern_table_size, sizeof(char *));
+
+        for (int i = 0; i < oldsize; i++)
+        {
+            if (oldtable[i] != NULL)
+            {
+                slot = nameHash(0, oldtable[i], strlen(oldtable[i])) & (db->intern_table_size - 1);
+
+                while (db->intern_table[slot] != NULL)
+                {
+                    slot = (slot + 1) & (db->intern_table_size - 1);
+                }
+
+                db->intern_table[slot] = oldtable[i];
+            }
+        }
+
+        free(oldtable);
+    }
+
+    slot = nameHash(0, name, len) & (db->intern_table_size - 1);
+
+    for (; db->intern_table[slot] != NULL; slot = (slot + 1) & (db->intern_table_size - 1))
+    {
+        if (strcmp(db->intern_table[slot], name) == 0)
+        {
+            return db->intern_table[slot];
+        }
+    }
+
+    db->intern_table[slot] = arenaStrdup(&db->arena, name);
+    db->intern_count++;
+    return db->intern_table[slot];
+}
+
+static inline void initDatabase(struct cma_database *db, struct cma_paths *paths, const char *uuid)
+{
+    struct cma_arena *arena = &db->arena;
+    db->object_slab.size = sizeof(struct cma_object);
+    db->track_slab.size = sizeof(struct media_track);
+    db->group_slab.size = sizeof(struct cma_group);
+    db->song_slab.size = sizeof(struct cma_song);
+
+    db->photos.metadata.ohfi = VITA_OHFI_PHOTO;
+    db->photos.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->photos.metadata.dataType = Photo;
+    db->photos.root_path = arenaStrdup(arena, paths->photosPath);
+    db->photos.num_filters = 3;
+    db->photos.filters = arenaAlloc(arena, 3 * sizeof(metadata_t));
+    createFilter(&db->photos, &db->photos.filters[0], "Folders",
                  VITA_DIR_TYPE_MASK_PHOTO | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR);
-    createFilter(&g_database->photos, &g_database->photos.filters[1], "All",
+    createFilter(&db->photos, &db->photos.filters[1], "All",
                  VITA_DIR_TYPE_MASK_PHOTO | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_ALL);
-    g_database->videos.metadata.ohfi = VITA_OHFI_VIDEO;
-    g_database->videos.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->videos.metadata.dataType = Video;
-    g_database->videos.path = strdup(paths->videosPath);
-    g_database->videos.num_filters = 2;
-    g_database->videos.filters = calloc(2, sizeof(metadata_t));
-    createFilter(&g_database->videos, &g_database->videos.filters[0], "Folders",
+    createFilter(&db->photos, &db->photos.filters[2], "Month",
+                 VITA_DIR_TYPE_MASK_PHOTO | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_MONTH);
+    db->photo_months.metadata.ohfi = db->photos.filters[2].ohfi;
+    db->photo_months.root = &db->photos;
+    db->videos.metadata.ohfi = VITA_OHFI_VIDEO;
+    db->videos.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->videos.metadata.dataType = Video;
+    db->videos.root_path = arenaStrdup(arena, paths->videosPath);
+    db->videos.num_filters = 3;
+    db->videos.filters = arenaAlloc(arena, 3 * sizeof(metadata_t));
+    createFilter(&db->videos, &db->videos.filters[0], "Folders",
                  VITA_DIR_TYPE_MASK_VIDEO | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR);
-    createFilter(&g_database->videos, &g_database->videos.filters[1], "All",
+    createFilter(&db->videos, &db->videos.filters[1], "All",
                  VITA_DIR_TYPE_MASK_VIDEO | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_ALL);
-    g_database->music.metadata.ohfi = VITA_OHFI_MUSIC;
-    g_database->music.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->music.metadata.dataType = Music;
-    g_database->music.path = strdup(paths->musicPath);
-    g_database->music.num_filters = 1;
-    g_database->music.filters = calloc(1, sizeof(metadata_t));
-    //createFilter (&g_database->music, &g_database->music.filters[0], "Folders", VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_PLAYLISTS); // folders not supported for music
-    createFilter(&g_database->music, &g_database->music.filters[0], "All",
+    createFilter(&db->videos, &db->videos.filters[2], "Month",
+                 VITA_DIR_TYPE_MASK_VIDEO | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_MONTH);
+    db->video_months.metadata.ohfi = db->videos.filters[2].ohfi;
+    db->video_months.root = &db->videos;
+    db->music.metadata.ohfi = VITA_OHFI_MUSIC;
+    db->music.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->music.metadata.dataType = Music;
+    db->music.root_path = arenaStrdup(arena, paths->musicPath);
+    db->music.num_filters = 5;
+    db->music.filters = arenaAlloc(arena, 5 * sizeof(metadata_t));
+    // folders are not supported for music, the groups are listed instead
+    createFilter(&db->music, &db->music.filters[0], "All",
                  VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_SONGS);
-    // TODO: Once metadata reading from files is done, add more special folder filters
-    g_database->vitaApps.metadata.ohfi = VITA_OHFI_VITAAPP;
-    g_database->vitaApps.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->vitaApps.metadata.dataType = App;
-    asprintf(&g_database->vitaApps.path, "%s/%s/%s", paths->appsPath, "APP", uuid);
-    g_database->pspApps.metadata.ohfi = VITA_OHFI_PSPAPP;
-    g_database->pspApps.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->pspApps.metadata.dataType = App;
-    asprintf(&g_database->pspApps.path, "%s/%s/%s", paths->appsPath, "PGAME", uuid);
-    g_database->pspSaves.metadata.ohfi = VITA_OHFI_PSPSAVE;
-    g_database->pspSaves.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->pspSaves.metadata.dataType = SaveData;
-    asprintf(&g_database->pspSaves.path, "%s/%s/%s", paths->appsPath, "PSAVEDATA", uuid);
-    g_database->psxApps.metadata.ohfi = VITA_OHFI_PSXAPP;
-    g_database->psxApps.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->psxApps.metadata.dataType = App;
-    asprintf(&g_database->psxApps.path, "%s/%s/%s", paths->appsPath, "PSGAME", uuid);
-    g_database->psmApps.metadata.ohfi = VITA_OHFI_PSMAPP;
-    g_database->psmApps.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->psmApps.metadata.dataType = App;
-    asprintf(&g_database->psmApps.path, "%s/%s/%s", paths->appsPath, "PSM", uuid);
-    g_database->backups.metadata.ohfi = VITA_OHFI_BACKUP;
-    g_database->backups.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
-    g_database->backups.metadata.dataType = App;
-    asprintf(&g_database->backups.path, "%s/%s/%s", paths->appsPath, "SYSTEM", uuid);
-    pthread_mutex_unlock(&g_database_lock);
-}
-
-// the database is structured as an array of linked list, each list representing a category (saves, vita games, etc)
-// each linked list contains the objects, files, directories, etc
-void createDatabase(struct cma_paths *paths, const char *uuid)
-{
-    pthread_mutexattr_init(&g_database_lock_attr);
-    pthread_mutexattr_settype(&g_database_lock_attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&g_database_lock, &g_database_lock_attr);
-
-    pthread_mutex_lock(&g_database_lock);
-    g_database = malloc(sizeof(struct cma_database));
-    memset(g_database, 0, sizeof(struct cma_database));
-    initDatabase(paths, uuid);
+    createFilter(&db->music, &db->music.filters[1], "Artists",
+                 VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_ARTISTS);
+    createFilter(&db->music, &db->music.filters[2], "Albums",
+                 VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_ALBUMS);
+    createFilter(&db->music, &db->music.filters[3], "Genres",
+                 VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_GENRES);
+    createFilter(&db->music, &db->music.filters[4], "Playlists",
+                 VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_PLAYLISTS);
+    // the groups in a view have the filter as their parent
+    db->artists.metadata.ohfi = db->music.filters[1].ohfi;
+    db->artists.root = &db->music;
+    db->genres.metadata.ohfi = db->music.filters[3].ohfi;
+    db->genres.root = &db->music;
+    db->playlists.metadata.ohfi = db->music.filters[4].ohfi;
+    db->playlists.root = &db->music;
+    db->vitaApps.metadata.ohfi = VITA_OHFI_VITAAPP;
+    db->vitaApps.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->vitaApps.metadata.dataType = App;
+    db->vitaApps.root_path = arenaPrintf(arena, "%s/%s/%s", paths->appsPath, "APP", uuid);
+    db->pspApps.metadata.ohfi = VITA_OHFI_PSPAPP;
+    db->pspApps.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->pspApps.metadata.dataType = App;
+    db->pspApps.root_path = arenaPrintf(arena, "%s/%s/%s", paths->appsPath, "PGAME", uuid);
+    db->pspSaves.metadata.ohfi = VITA_OHFI_PSPSAVE;
+    db->pspSaves.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->pspSaves.metadata.dataType = SaveData;
+    db->pspSaves.root_path = arenaPrintf(arena, "%s/%s/%s", paths->appsPath, "PSAVEDATA", uuid);
+    db->psxApps.metadata.ohfi = VITA_OHFI_PSXAPP;
+    db->psxApps.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->psxApps.metadata.dataType = App;
+    db->psxApps.root_path = arenaPrintf(arena, "%s/%s/%s", paths->appsPath, "PSGAME", uuid);
+    db->psmApps.metadata.ohfi = VITA_OHFI_PSMAPP;
+    db->psmApps.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->psmApps.metadata.dataType = App;
+    db->psmApps.root_path = arenaPrintf(arena, "%s/%s/%s", paths->appsPath, "PSM", uuid);
+    db->backups.metadata.ohfi = VITA_OHFI_BACKUP;
+    db->backups.metadata.type = VITA_DIR_TYPE_MASK_ROOT | VITA_DIR_TYPE_MASK_REGULAR;
+    db->backups.metadata.dataType = App;
+    db->backups.root_path = arenaPrintf(arena, "%s/%s/%s", paths->appsPath, "SYSTEM", uuid);
+
+    struct cma_object *db_objects = (struct cma_object *)db;
+
+    pthread_mutex_lock(&db->table_lock);
+
+    for (int i = 0; i < DATABASE_NUM_ROOTS; i++)
+    {
+        db_objects[i].category = i;
+        registerObject(db, db_objects[i].metadata.ohfi, &db_objects[i]);
+    }
+
+    pthread_mutex_unlock(&db->table_lock);
+}
+
+// the database is structured as an array of trees, each tree representing a category (saves, vita games, etc)
+// each tree mirrors the directory layout with the master object at the top
+// the new database belongs to this thread until publishDatabase(), the Vita keeps using the old one meanwhile
+void createEmptyDatabase(struct cma_paths *paths, const char *uuid)
+{
+    struct cma_database *db = calloc(1, sizeof(struct cma_database));
+    pthread_mutexattr_t attr;
+    int i;
+
+    assert(offsetof(struct cma_database, category_locks) == DATABASE_NUM_ROOTS * sizeof(struct cma_object));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+    for (i = 0; i < DATABASE_NUM_ROOTS; i++)
+    {
+        pthread_mutex_init(&db->category_locks[i], &attr);
+    }
+
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&db->table_lock, NULL);
+
+    // only this thread publishes, so the old database stays around until we are done with it
+    if ((db->previous = g_database) != NULL)
+    {
+        db->previous_changes = __atomic_load_n(&db->previous->changes, __ATOMIC_SEQ_CST);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &db->build_start);
+    g_current = db;
+    g_building = 1;
+    initDatabase(db, paths, uuid);
+}
+
+// builds a new database off to the side and swaps it in, returns 1 if the old one changed in the meantime
+int createDatabase(struct cma_paths *paths, const char *uuid)
+{
+    createEmptyDatabase(paths, uuid);
+
+    struct cma_object *roots[DATABASE_NUM_ROOTS];
     int i;
-    struct cma_object *current;
     // the database is basically an array of cma_objects, so we'll cast it so
-    struct cma_object *db_objects = (struct cma_object *)g_database;
-    int count = sizeof(struct cma_database) / sizeof(struct cma_object);
+    struct cma_object *db_objects = (struct cma_object *)g_current;
 
-    // loop through all the master objects
-    for (i = 0; i < count; i++)
+    // scan all the master objects together
+    for (i = 0; i < DATABASE_NUM_ROOTS; i++)
     {
-        current = &db_objects[i];
-        addEntriesForDirectory(current, current->metadata.ohfi);
+        roots[i] = &db_objects[i];
     }
 
-    pthread_mutex_unlock(&g_database_lock);
+    scanDirectories(roots, DATABASE_NUM_ROOTS);
+    return publishDatabase();
 }
 
-static void freeCMAObject(struct cma_object *obj)
+// the strings stay in the arena until the database is destroyed
+static void freeCMAObject(struct cma_database *db, struct cma_object *obj)
 {
     if (obj == NULL)
         return;
 
     metadata_t *meta = &obj->metadata;
-    free(meta->name);
-    free(meta->path);
 
-    if (MASK_SET(meta->dataType, SaveData | Folder))
+    if (MASK_SET(meta->dataType, Photo | File))
     {
-        free(meta->data.saveData.detail);
-        free(meta->data.saveData.dirName);
-        free(meta->data.saveData.savedataTitle);
-    }
-    else if (MASK_SET(meta->dataType, Photo | File))
-    {
-        free(meta->data.photo.tracks);
-        free(meta->data.photo.title);
-        free(meta->data.photo.fileName);
+        slabFree(&db->track_slab, meta->data.photo.tracks);
     }
     else if (MASK_SET(meta->dataType, Music | File))
     {
-        free(meta->data.music.tracks);
-        free(meta->data.music.title);
-        free(meta->data.music.fileName);
-        free(meta->data.music.album);
-        free(meta->data.music.artist);
+        slabFree(&db->track_slab, meta->data.music.tracks);
     }
     else if (MASK_SET(meta->dataType, Video | File))
     {
-        free(meta->data.video.title);
-        free(meta->data.video.explanation);
-        free(meta->data.video.fileName);
-        free(meta->data.video.copyright);
-        free(meta->data.video.tracks);
+        slabFree(&db->track_slab, meta->data.video.tracks);
     }
 
-    free(obj->path);
-    free(obj->filters);
-
     if (obj->metadata.ohfi >= OHFI_OFFSET)
     {
-        free(obj);
+        slabFree(&db->object_slab, obj);
+    }
+}
+
+static void freeDatabase(struct cma_database *db)
+{
+    for (int i = 0; i < db->ohfi_table_size; i++)
+    {
+        forgetElement(db, i);
+    }
+
+    // every object and string goes with the arena, and so do the OHFI tables
+    for (int i = 0; i < DATABASE_NUM_ROOTS; i++)
+    {
+        freeList(&db->results[i].list);
+        free(db->columns[i].types);
+        free(db->columns[i].objects);
+    }
+
+    // the groups are in the arena, only what months hold is not
+    for (int i = 0; i < db->group_table_size; i++)
+    {
+        for (struct cma_group *group = db->group_table[i]; group != NULL; group = group->next_key)
+        {
+            free(group->objects);
+        }
+    }
+
+    arenaRelease(&db->arena);
+    free(db->xml_table);
+    free(db->name_table);
+    free(db->print_table);
+    free(db->group_table);
+    free(db->group_ohfi_table);
+    free(db->untagged);
+    free(db->intern_table);
+
+    for (int i = 0; i < DATABASE_NUM_ROOTS; i++)
+    {
+        pthread_mutex_destroy(&db->category_locks[i]);
+    }
+
+    pthread_mutex_destroy(&db->table_lock);
+    free(db);
+}
+
+// waits until no thread has the database pinned and frees it, returns how many changes it saw on disk
+static unsigned int retireDatabase(struct cma_database *db)
+{
+    unsigned int changes;
+
+    // nobody can pin it anymore, so this only waits for handlers that were already running
+    while (__atomic_load_n(&db->readers, __ATOMIC_SEQ_CST) > 0)
+    {
+        usleep(1000);
+    }
+
+    changes = db->changes;
+    freeDatabase(db);
+    return changes;
+}
+
+// makes the database built by this thread the one the Vita sees and frees the old one
+// returns 1 if something changed on disk while the new one was built, so the new one may be missing it
+// reading tags or folders only fills in what was already there, that does not count
+int publishDatabase(void)
+{
+    struct cma_database *db = g_current;
+    struct cma_database *old = db->previous;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    db->build_seconds = (now.tv_sec - db->build_start.tv_sec) + (now.tv_nsec - db->build_start.tv_nsec) / 1e9;
+    db->build_time = time(NULL);
+    g_current = NULL;
+    g_building = 0;
+    db->previous = NULL;
+    __atomic_store_n(&g_database, db, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&db->table_lock);
+
+    if (db->untagged_head < db->untagged_count)
+    {
+        wakeTagging();
     }
+
+    pthread_mutex_unlock(&db->table_lock);
+
+    return old != NULL && retireDatabase(old) != db->previous_changes;
+}
+
+// throws away the database this thread was building
+void discardDatabase(void)
+{
+    struct cma_database *db = g_current;
+
+    g_current = NULL;
+    g_building = 0;
+    freeDatabase(db);
 }
 
 void destroyDatabase()
 {
-    if (g_database == NULL)
+    struct cma_database *db = g_database;
+
+    if (db == NULL)
     {
         return; // can't destroy what hasn't been created
     }
 
-    pthread_mutex_lock(&g_database_lock);
+    __atomic_store_n(&g_database, NULL, __ATOMIC_SEQ_CST);
+    retireDatabase(db);
+}
+
+// the database this thread is working on, only stable while this thread has something locked
+struct cma_database *currentDatabase(void)
+{
+    return g_current != NULL ? g_current : __atomic_load_n(&g_database, __ATOMIC_ACQUIRE);
+}
+
+// the outermost lock pins the published database, so it is not freed until the matching unpin
+static struct cma_database *pinDatabase(void)
+{
+    struct cma_database *db;
+
+    if (g_lock_depth++ == 0 && !g_building)
+    {
+        while ((db = __atomic_load_n(&g_database, __ATOMIC_SEQ_CST)) != NULL)
+        {
+            __atomic_add_fetch(&db->readers, 1, __ATOMIC_SEQ_CST);
+
+            // a new database may have been published before we were counted
+            if (__atomic_load_n(&g_database, __ATOMIC_SEQ_CST) == db)
+            {
+                break;
+            }
+
+            __atomic_sub_fetch(&db->readers, 1, __ATOMIC_SEQ_CST);
+        }
+
+        g_current = db;
+    }
+
+    return g_current;
+}
+
+static void unpinDatabase(void)
+{
+    struct cma_database *db = g_current;
+
+    if (--g_lock_depth == 0 && !g_building && db != NULL)
+    {
+        g_current = NULL;
+        __atomic_sub_fetch(&db->readers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// locks every category, only for the few things that need the whole database at once
+// taking it while holding a single category can deadlock
+inline void lockDatabase()
+{
+    struct cma_database *db = pinDatabase();
+
+    for (int i = 0; db != NULL && i < DATABASE_NUM_ROOTS; i++)
+    {
+        pthread_mutex_lock(&db->category_locks[i]);
+    }
+}
+
+inline void unlockDatabase()
+{
+    struct cma_database *db = g_current;
+
+    for (int i = DATABASE_NUM_ROOTS - 1; db != NULL && i >= 0; i--)
+    {
+        pthread_mutex_unlock(&db->category_locks[i]);
+    }
+
+    unpinDatabase();
+}
+
+// finds an object and locks the category it is in, returns NULL with nothing locked if there is no such object
+// a thread only ever holds one category, so photos, music and saves never wait on each other
+struct cma_object *lockObject(int ohfi)
+{
+    struct cma_database *db = pinDatabase();
+    struct cma_object *object;
+    int category;
+
+    __atomic_add_fetch(&g_ohfi_lookups, 1, __ATOMIC_RELAXED);
+
+    while (db != NULL && (object = lookupOhfi(db, ohfi)) != NULL)
+    {
+        // objects are never given back to the system while the database is pinned, so this is only stale at worst
+        category = object->category;
+        pthread_mutex_lock(&db->category_locks[category]);
+
+        if (lookupOhfi(db, ohfi) == object && object->category == category)
+        {
+            return object;
+        }
+
+        // removed while we were waiting
+        pthread_mutex_unlock(&db->category_locks[category]);
+    }
+
+    unpinDatabase();
+    return NULL;
+}
+
+void unlockObject(const struct cma_object *object)
+{
+    if (object != NULL)
+    {
+        unlockCategory(object);
+    }
+}
+
+// locks the category of an object the caller already holds a lock for, or is building
+void lockCategory(const struct cma_object *object)
+{
+    struct cma_database *db = pinDatabase();
+
+    pthread_mutex_lock(&db->category_locks[object->category]);
+}
+
+void unlockCategory(const struct cma_object *object)
+{
+    pthread_mutex_unlock(&g_current->category_locks[object->category]);
+    unpinDatabase();
+}
+
+// locks a whole category by its index, returns its master object or NULL if there is no database
+struct cma_object *lockRoot(int index)
+{
+    struct cma_database *db = pinDatabase();
+
+    if (db == NULL)
+    {
+        unpinDatabase();
+        return NULL;
+    }
+
+    pthread_mutex_lock(&db->category_locks[index]);
+    return &((struct cma_object *)db)[index];
+}
+
+// anything that was in the old database keeps its OHFI, so a rebuild does not pull objects out from under the Vita
+static int newOhfi(struct cma_database *db, int ohfiParent, const char *name)
+{
+    struct cma_object *old;
+    int ohfi = 0;
+
+    if (db->previous != NULL)
+    {
+        // only the table lock, nothing in the old database waits on ours
+        pthread_mutex_lock(&db->previous->table_lock);
+
+        if ((old = lookupName(db->previous, ohfiParent, name, strlen(name))) != NULL)
+        {
+            ohfi = old->metadata.ohfi;
+        }
+
+        pthread_mutex_unlock(&db->previous->table_lock);
+    }
+
+    return ohfi ? ohfi : __atomic_fetch_add(&g_ohfi_count, 1, __ATOMIC_RELAXED);
+}
+
+void addEntriesForDirectory(struct cma_object *current)
+{
+    lockCategory(current);
+    char path[PATH_MAX];
+    struct cma_entry *entries;
+    int count;
+    int i;
+
+    if ((count = readDirectory(objectPath(current, path, sizeof(path)), &entries)) < 0)
+    {
+        unlockCategory(current);
+        return;
+    }
+
+    unsigned long totalSize = 0;
+    // add the whole directory at once, then go into the subdirectories
+    addEntriesToDatabase(current, entries, count);
+
+    for (i = 0; i < count; i++)
+    {
+        if (entries[i].object->metadata.dataType & Folder)
+        {
+            addEntriesForDirectory(entries[i].object);
+        }
+
+        totalSize += entries[i].object->metadata.size;
+        free(entries[i].name);
+    }
+
+    free(entries);
+    current->metadata.size += totalSize;
+    unlockCategory(current);
+}
+
+// inserts child after *p_next's predecessor and returns where the next sorted child can go
+static struct cma_object **insertChild(struct cma_object *parent, struct cma_object **p_next,
+                                       struct cma_object *child)
+{
+    // skip to the sorted position, starting at p_next
+    while (*p_next != NULL && strcmp((*p_next)->metadata.name, child->metadata.name) <= 0)
+    {
+        p_next = &(*p_next)->next_sibling;
+    }
+
+    child->parent = parent;
+    child->next_sibling = *p_next;
+    // p_next is either the first child pointer or inside the previous sibling
+    child->prev_sibling = p_next == &parent->first_child ? NULL
+                          : (struct cma_object *)((char *)p_next - offsetof(struct cma_object, next_sibling));
+    *p_next = child;
+
+    if (child->next_sibling == NULL)
+    {
+        parent->last_child = child;
+    }
+    else
+    {
+        child->next_sibling->prev_sibling = child;
+    }
+
+    return &child->next_sibling;
+}
+
+// keeps the children sorted by name
+static void linkChild(struct cma_object *parent, struct cma_object *child)
+{
+    // names usually come in order, so try the end first
+    if (parent->last_child != NULL && strcmp(parent->last_child->metadata.name, child->metadata.name) <= 0)
+    {
+        insertChild(parent, &parent->last_child->next_sibling, child);
+    }
+    else
+    {
+        insertChild(parent, &parent->first_child, child);
+    }
+}
+
+static void unlinkChild(struct cma_object *child)
+{
+    if (child->prev_sibling != NULL)
+    {
+        child->prev_sibling->next_sibling = child->next_sibling;
+    }
+    else
+    {
+        child->parent->first_child = child->next_sibling;
+    }
+
+    if (child->next_sibling != NULL)
+    {
+        child->next_sibling->prev_sibling = child->prev_sibling;
+    }
+    else
+    {
+        child->parent->last_child = child->prev_sibling;
+    }
+
+    child->next_sibling = NULL;
+    child->prev_sibling = NULL;
+}
+
+// the name is shared by everything that shows it
+static void setObjectName(struct cma_object *object, char *name)
+{
+    metadata_t *meta = &object->metadata;
+    meta->name = name;
+
+    if (MASK_SET(meta->dataType, SaveData | Folder))
+    {
+        meta->data.saveData.title = name;
+        meta->data.saveData.dirName = name;
+    }
+    else if (MASK_SET(meta->dataType, Photo | File))
+    {
+        meta->data.photo.title = name;
+        meta->data.photo.fileName = name;
+    }
+    else if (MASK_SET(meta->dataType, Music | File))
+    {
+        // unless it has a title of its own, see setTags()
+        if (meta->data.music.title == NULL || meta->data.music.title == meta->data.music.fileName)
+        {
+            meta->data.music.title = name;
+        }
+
+        meta->data.music.fileName = name;
+    }
+    else if (MASK_SET(meta->dataType, Video | File))
+    {
+        meta->data.video.title = name;
+        meta->data.video.fileName = name;
+    }
+}
+
+// the table lock must be held
+// the category of the object must be locked
+static void addToColumn(struct cma_database *db, struct cma_object *object)
+{
+    struct cma_column *column = &db->columns[object->category];
+
+    if (column->count == column->capacity)
+    {
+        column->capacity = column->capacity ? column->capacity * 2 : 1024;
+        column->types = realloc(column->types, column->capacity * sizeof(unsigned int));
+        column->objects = realloc(column->objects, column->capacity * sizeof(struct cma_object *));
+    }
+
+    object->column = column->count;
+    column->types[column->count] = object->metadata.dataType;
+    column->objects[column->count++] = object;
+}
+
+// leaves a hole so the other objects keep their place, see compactColumn()
+static void removeFromColumn(struct cma_database *db, struct cma_object *object)
+{
+    struct cma_column *column = &db->columns[object->category];
+
+    column->types[object->column] = 0;
+    column->objects[object->column] = NULL;
+    column->holes++;
+}
+
+// squeezes out the holes once they are half of the column
+static void compactColumn(struct cma_column *column)
+{
+    int i;
+    int j = 0;
+
+    if (column->holes * 2 < column->count)
+    {
+        return;
+    }
+
+    for (i = 0; i < column->count; i++)
+    {
+        if (column->objects[i] != NULL)
+        {
+            column->types[j] = column->types[i];
+            column->objects[j] = column->objects[i];
+            column->objects[j]->column = j;
+            j++;
+        }
+    }
+
+    column->count = j;
+    column->holes = 0;
+}
+
+static inline unsigned int groupHash(int ohfiParent, const char *key)
+{
+    return nameHash(ohfiParent, key, strlen(key));
+}
+
+static void hashGroup(struct cma_database *db, struct cma_group *group)
+{
+    struct cma_group *entry;
+    struct cma_group *next;
+    unsigned int slot;
+
+    if (db->group_count >= db->group_table_size)
+    {
+        // grow both tables and move everything over
+        int oldsize = db->group_table_size;
+        struct cma_group **oldtable = db->group_table;
+
+        db->group_table_size = oldsize ? oldsize * 2 : 256;
+        db->group_table = calloc(db->group_table_size, sizeof(struct cma_group *));
+        free(db->group_ohfi_table);
+        db->group_ohfi_table = calloc(db->group_table_size, sizeof(struct cma_group *));
+
+        for (int i = 0; i < oldsize; i++)
+        {
+            for (entry = oldtable[i]; entry != NULL; entry = next)
+            {
+                next = entry->next_key;
+                slot = groupHash(entry->metadata.ohfiParent, entry->key) & (db->group_table_size - 1);
+                entry->next_key = db->group_table[slot];
+                db->group_table[slot] = entry;
+                slot = entry->metadata.ohfi & (db->group_table_size - 1);
+                entry->next_ohfi = db->group_ohfi_table[slot];
+                db->group_ohfi_table[slot] = entry;
+            }
+        }
+
+        free(oldtable);
+    }
+
+    slot = groupHash(group->metadata.ohfiParent, group->key) & (db->group_table_size - 1);
+    group->next_key = db->group_table[slot];
+    db->group_table[slot] = group;
+    slot = group->metadata.ohfi & (db->group_table_size - 1);
+    group->next_ohfi = db->group_ohfi_table[slot];
+    db->group_ohfi_table[slot] = group;
+    db->group_count++;
+}
+
+static void unhashGroup(struct cma_database *db, struct cma_group *group)
+{
+    struct cma_group **p_entry;
+
+    p_entry = &db->group_table[groupHash(group->metadata.ohfiParent, group->key) & (db->group_table_size - 1)];
+
+    for (; *p_entry != group; p_entry = &(*p_entry)->next_key)
+        ;
+
+    *p_entry = group->next_key;
+    p_entry = &db->group_ohfi_table[group->metadata.ohfi & (db->group_table_size - 1)];
+
+    for (; *p_entry != group; p_entry = &(*p_entry)->next_ohfi)
+        ;
+
+    *p_entry = group->next_ohfi;
+    db->group_count--;
+}
+
+// the group for key under the artist or view with OHFI ohfiParent, NULL if there is none
+// playlists can share a name, so this finds one of them
+static struct cma_group *lookupGroup(struct cma_database *db, int ohfiParent, const char *key)
+{
+    struct cma_group *entry;
+
+    if (db->group_table_size == 0)
+    {
+        return NULL;
+    }
+
+    entry = db->group_table[groupHash(ohfiParent, key) & (db->group_table_size - 1)];
+
+    for (; entry != NULL; entry = entry->next_key)
+    {
+        if (entry->metadata.ohfiParent == ohfiParent && strcmp(entry->key, key) == 0)
+        {
+            break;
+        }
+    }
+
+    return entry;
+}
+
+// the group listed as ohfi, NULL if it is not a group
+static struct cma_group *ohfiToGroup(struct cma_database *db, int ohfi)
+{
+    struct cma_group *entry = NULL;
+
+    pthread_mutex_lock(&db->table_lock);
+
+    if (db->group_table_size > 0)
+    {
+        entry = db->group_ohfi_table[ohfi & (db->group_table_size - 1)];
+
+        for (; entry != NULL && entry->metadata.ohfi != ohfi; entry = entry->next_ohfi)
+            ;
+    }
+
+    pthread_mutex_unlock(&db->table_lock);
+    return entry;
+}
+
+// makes a group under owner, the table lock must be held
+static struct cma_group *newGroup(struct cma_database *db, struct cma_group *owner, const char *key, int type)
+{
+    struct cma_group *group = slabAlloc(&db->arena, &db->group_slab);
+    struct cma_group *old;
+    struct cma_group *prev;
+    int ohfi = 0;
+
+    // groups keep their OHFI over a rebuild too, as long as no other group took it already
+    if (db->previous != NULL)
+    {
+        pthread_mutex_lock(&db->previous->table_lock);
+
+        if ((old = lookupGroup(db->previous, owner->metadata.ohfi, key)) != NULL && lookupOhfi(db, old->metadata.ohfi) == NULL)
+        {
+            ohfi = old->metadata.ohfi;
+        }
+
+        pthread_mutex_unlock(&db->previous->table_lock);
+    }
+
+    group->key = key;
+    group->root = owner->root;
+    group->owner = owner;
+    group->metadata.ohfiParent = owner->metadata.ohfi;
+    group->metadata.ohfi = ohfi ? ohfi : __atomic_fetch_add(&g_ohfi_count, 1, __ATOMIC_RELAXED);
+    group->metadata.name = key[0] != '\0' ? (char *)key : internName(db, "Unknown");
+    group->metadata.path = internName(db, "");
+    group->metadata.type = type;
+    group->metadata.dataType = Folder | Special;
+
+    // things are mostly added in order, so look from the end
+    for (prev = owner->last_member; prev != NULL && strcmp(prev->key, key) > 0; prev = prev->prev_member)
+        ;
+
+    group->prev_member = prev;
+    group->next_member = prev != NULL ? prev->next_member : owner->first_member;
+    *(prev != NULL ? &prev->next_member : &owner->first_member) = group;
+    *(group->next_member != NULL ? &group->next_member->prev_member : &owner->last_member) = group;
+    owner->count++;
+
+    registerObject(db, group->metadata.ohfi, group->root);
+    hashGroup(db, group);
+    return group;
+}
+
+// takes out a group with nothing left in it, and its artist if that was the last album
+static void removeGroup(struct cma_database *db, struct cma_group *group)
+{
+    struct cma_group *owner = group->owner;
+
+    *(group->prev_member != NULL ? &group->prev_member->next_member : &owner->first_member) = group->next_member;
+    *(group->next_member != NULL ? &group->next_member->prev_member : &owner->last_member) = group->prev_member;
+    unregisterObject(db, group->metadata.ohfi);
+    unhashGroup(db, group);
+    free(group->objects);
+    slabFree(&db->group_slab, group);
+
+    if (--owner->count == 0 && owner->owner != NULL)
+    {
+        removeGroup(db, owner);
+    }
+}
+
+// the group for key under owner, made if there is none yet
+static struct cma_group *findGroup(struct cma_database *db, struct cma_group *owner, const char *key, int type)
+{
+    struct cma_group *group = lookupGroup(db, owner->metadata.ohfi, key);
+
+    return group != NULL ? group : newGroup(db, owner, key, type);
+}
+
+static void addSong(struct cma_group *group, struct cma_song *song, int link)
+{
+    song->groups[link] = group;
+    song->prev[link] = group->last_song;
+    song->next[link] = NULL;
+    *(group->last_song != NULL ? &group->last_song->next[link] : &group->first_song) = song;
+    group->last_song = song;
+    group->count++;
+}
+
+static void removeSong(struct cma_database *db, struct cma_song *song, int link)
+{
+    struct cma_group *group = song->groups[link];
+
+    *(song->prev[link] != NULL ? &song->prev[link]->next[link] : &group->first_song) = song->next[link];
+    *(song->next[link] != NULL ? &song->next[link]->prev[link] : &group->last_song) = song->prev[link];
+
+    if (--group->count == 0)
+    {
+        removeGroup(db, group);
+    }
+}
+
+static int isPlaylist(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    return ext != NULL && (strcasecmp(ext, ".m3u") == 0 || strcasecmp(ext, ".m3u8") == 0);
+}
+
+// files the song under the artist and album it has now, and under its genre
+// the table lock must be held
+static void linkSong(struct cma_database *db, struct cma_song *song)
+{
+    const struct metadata_music *music = &song->object->metadata.data.music;
+    struct cma_group *group;
+
+    group = findGroup(db, &db->artists, music->artist, VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_ARTISTS);
+    addSong(findGroup(db, group, music->album, VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_ALBUMS), song, SONG_ALBUM);
+    addSong(findGroup(db, &db->genres, song->genre, VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_GENRES),
+            song, SONG_GENRE);
+}
+
+static void unlinkSong(struct cma_database *db, struct cma_song *song)
+{
+    removeSong(db, song, SONG_ALBUM);
+    removeSong(db, song, SONG_GENRE);
+}
+
+// leaves the file for the tag readers, the table lock must be held
+static void queueSong(struct cma_database *db, struct cma_song *song)
+{
+    int empty = db->untagged_head == db->untagged_count;
+
+    if (db->untagged_count == db->untagged_capacity)
+    {
+        db->untagged_capacity = db->untagged_capacity ? db->untagged_capacity * 2 : 256;
+        db->untagged = realloc(db->untagged, db->untagged_capacity * sizeof(int));
+    }
+
+    song->tagged = 0;
+    db->untagged[db->untagged_count++] = song->object->metadata.ohfi;
+
+    // they only look at the published database, a new one wakes them once it is
+    if (empty && db == __atomic_load_n(&g_database, __ATOMIC_SEQ_CST))
+    {
+        wakeTagging();
+    }
+}
+
+// a file that has not changed since the last database keeps the tags read for it then
+// the table lock must be held, the one of the previous database is taken too
+static int copyTags(struct cma_database *db, struct cma_object *object)
+{
+    struct metadata_music *music = &object->metadata.data.music;
+    const struct metadata_music *before;
+    struct cma_object *old;
+    int copied = 0;
+
+    if (db->previous == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&db->previous->table_lock);
+    old = lookupName(db->previous, object->metadata.ohfiParent, object->metadata.name, strlen(object->metadata.name));
+
+    if (old != NULL && old->song != NULL && old->song->tagged
+            && old->metadata.dateTimeCreated == object->metadata.dateTimeCreated)
+    {
+        before = &old->metadata.data.music;
+        music->title = internName(db, before->title);
+        music->artist = internName(db, before->artist);
+        music->album = internName(db, before->album);
+        music->tracks->data.track_audio.codecType = before->tracks->data.track_audio.codecType;
+        music->tracks->data.track_audio.bitrate = before->tracks->data.track_audio.bitrate;
+        object->song->genre = internName(db, old->song->genre);
+        object->song->tagged = 1;
+        copied = 1;
+    }
+
+    pthread_mutex_unlock(&db->previous->table_lock);
+    return copied;
+}
+
+// puts a music file in the groups for its artist, album and genre, or makes a playlist of it
+// the table lock must be held
+static void indexSong(struct cma_database *db, struct cma_object *object)
+{
+    struct cma_group *group;
+    struct cma_song *song;
+    char *name;
+
+    if (isPlaylist(object->metadata.name))
+    {
+        name = strndupa(object->metadata.name, strrchr(object->metadata.name, '.') - object->metadata.name);
+        group = newGroup(db, &db->playlists, internName(db, name),
+                         VITA_DIR_TYPE_MASK_MUSIC | VITA_DIR_TYPE_MASK_PLAYLISTS);
+        group->playlist = object;
+        return;
+    }
+
+    song = slabAlloc(&db->arena, &db->song_slab);
+    song->object = object;
+    song->genre = internName(db, "");
+    object->song = song;
+
+    // the tags are read in the background, until then it is filed by its folder
+    if (!copyTags(db, object))
+    {
+        queueSong(db, song);
+    }
+
+    linkSong(db, song);
+}
+
+// the table lock must be held
+static void unindexSong(struct cma_database *db, struct cma_object *object)
+{
+    struct cma_song *song = object->song;
+    struct cma_group *group;
+
+    if (song == NULL)
+    {
+        // only a playlist has no song, there are never many of them
+        for (group = db->playlists.first_member; group != NULL && group->playlist != object; group = group->next_member)
+            ;
+
+        if (group != NULL)
+        {
+            removeGroup(db, group);
+        }
+
+        return;
+    }
+
+    unlinkSong(db, song);
+    object->song = NULL;
+    slabFree(&db->song_slab, song);
+}
+
+// the photos or videos a month is listed under, NULL for anything else
+static struct cma_group *monthView(struct cma_database *db, const struct cma_object *object)
+{
+    if (MASK_SET(object->metadata.dataType, Photo | File))
+    {
+        return &db->photo_months;
+    }
+
+    if (MASK_SET(object->metadata.dataType, Video | File))
+    {
+        return &db->video_months;
+    }
+
+    return NULL;
+}
+
+// in local time, the way the Vita shows it
+static char *monthKey(struct cma_database *db, time_t time)
+{
+    char key[16];
+    struct tm tm;
+
+    localtime_r(&time, &tm);
+    strftime(key, sizeof(key), "%Y-%m", &tm);
+    return internName(db, key);
+}
+
+// the first object in the month made after time
+static int monthPosition(const struct cma_group *month, unsigned long time)
+{
+    int low = 0;
+    int high = month->count;
+    int mid;
+
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+
+        if (month->objects[mid]->metadata.dateTimeCreated <= time)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+// puts a photo or video in the month it was made in, the table lock must be held
+static void indexMonth(struct cma_database *db, struct cma_object *object)
+{
+    struct cma_group *view = monthView(db, object);
+    struct cma_group *month;
+    int type = view == &db->photo_months ? VITA_DIR_TYPE_MASK_PHOTO : VITA_DIR_TYPE_MASK_VIDEO;
+    int i;
+
+    month = findGroup(db, view, monthKey(db, object->metadata.dateTimeCreated), type | VITA_DIR_TYPE_MASK_MONTH);
+
+    if (month->count == month->capacity)
+    {
+        month->capacity = month->capacity ? month->capacity * 2 : 16;
+        month->objects = realloc(month->objects, month->capacity * sizeof(struct cma_object *));
+    }
+
+    i = monthPosition(month, object->metadata.dateTimeCreated);
+    memmove(&month->objects[i + 1], &month->objects[i], (month->count - i) * sizeof(struct cma_object *));
+    month->objects[i] = object;
+    month->count++;
+    object->month = month;
+}
+
+// takes it out of the month it was put in, whatever its time or the time zone say now
+// the table lock must be held
+static void unindexMonth(struct cma_database *db, struct cma_object *object)
+{
+    struct cma_group *month = object->month;
+    int i;
+
+    if (month == NULL)
+    {
+        LOG(LERROR, "%s is not in any month.\n", object->metadata.name);
+        return;
+    }
+
+    // objects made at the same time are together, just before where a new one would go
+    for (i = monthPosition(month, object->metadata.dateTimeCreated) - 1; i >= 0 && month->objects[i] != object; i--)
+        ;
+
+    // only if its time was changed without taking it out first
+    if (i < 0)
+    {
+        for (i = month->count - 1; i >= 0 && month->objects[i] != object; i--)
+            ;
+    }
+
+    object->month = NULL;
+
+    if (i < 0)
+    {
+        LOG(LERROR, "%s is missing from its month.\n", object->metadata.name);
+        return;
+    }
+
+    memmove(&month->objects[i], &month->objects[i + 1], (month->count - i - 1) * sizeof(struct cma_object *));
+
+    if (--month->count == 0)
+    {
+        removeGroup(db, month);
+    }
+}
+
+static struct cma_object *newObject(struct cma_database *db, struct cma_object *root, const char *name, size_t size,
+                                    const enum DataType type, time_t created)
+{
+    struct cma_arena *arena = &db->arena;
+    struct cma_object *current = slabAlloc(arena, &db->object_slab);
+    char *empty = internName(db, "");
+    current->metadata.ohfiParent = root->metadata.ohfi;
+    current->metadata.ohfi = newOhfi(db, current->metadata.ohfiParent, name);
+    current->metadata.type = VITA_DIR_TYPE_MASK_REGULAR; // ignored for files
+    current->metadata.dateTimeCreated = created;
+    current->metadata.size = size;
+    current->metadata.dataType = type | (root->metadata.dataType & ~Folder); // get parent attributes except Folder
+    current->category = root->category;
+
+    // create additional metadata
+    // TODO: Read real metadata for files
+    if (MASK_SET(current->metadata.dataType, SaveData | Folder))
+    {
+        current->metadata.data.saveData.detail = empty;
+        current->metadata.data.saveData.savedataTitle = empty;
+        current->metadata.data.saveData.dateTimeUpdated = 0;
+        current->metadata.data.saveData.statusType = 1;
+    }
+    else if (MASK_SET(current->metadata.dataType, Photo | File))
+    {
+        current->metadata.data.photo.fileFormatType = 28; // working
+        current->metadata.data.photo.statusType = 1;
+        current->metadata.data.photo.dateTimeOriginal = created;
+        current->metadata.data.photo.numTracks = 1;
+        current->metadata.data.photo.tracks = slabAlloc(arena, &db->track_slab);
+        current->metadata.data.photo.tracks->type = VITA_TRACK_TYPE_PHOTO;
+        current->metadata.data.photo.tracks->data.track_photo.codecType = 17; // JPEG?
+    }
+    else if (MASK_SET(current->metadata.dataType, Music | File))
+    {
+        current->metadata.data.music.fileFormatType = 20;
+        current->metadata.data.music.statusType = 1;
+        current->metadata.data.music.album = root->metadata.name ? root->metadata.name : empty;
+        current->metadata.data.music.artist = empty;
+        current->metadata.data.music.numTracks = 1;
+        current->metadata.data.music.tracks = slabAlloc(arena, &db->track_slab);
+        current->metadata.data.music.tracks->type = VITA_TRACK_TYPE_AUDIO;
+        current->metadata.data.music.tracks->data.track_photo.codecType = 12; // MP3?
+    }
+    else if (MASK_SET(current->metadata.dataType, Video | File))
+    {
+        current->metadata.data.video.explanation = empty;
+        current->metadata.data.video.copyright = empty;
+        current->metadata.data.video.dateTimeUpdated = created;
+        current->metadata.data.video.statusType = 1;
+        current->metadata.data.video.fileFormatType = 1;
+        current->metadata.data.video.parentalLevel = 0;
+        current->metadata.data.video.numTracks = 1;
+        current->metadata.data.video.tracks = slabAlloc(arena, &db->track_slab);
+        current->metadata.data.video.tracks->type = VITA_TRACK_TYPE_VIDEO;
+        current->metadata.data.video.tracks->data.track_video.codecType = 3; // this codec is working
+    }
+
+    setObjectName(current, internName(db, name));
+
+    registerObject(db, current->metadata.ohfi, current);
+    hashObject(db, current);
+    addToColumn(db, current);
+
+    if (isPrinted(current))
+    {
+        printObject(db, current);
+    }
+
+    if (MASK_SET(current->metadata.dataType, Music | File))
+    {
+        indexSong(db, current);
+    }
+    else if (monthView(db, current) != NULL)
+    {
+        indexMonth(db, current);
+    }
+
+    return current;
+}
+
+// adds what the folders of a growing file do not count yet, the category must be locked
+static void settleSize(struct cma_database *db, int category)
+{
+    struct cma_growth *growing = &db->growing[category];
+    struct cma_object *object;
+
+    // anything that moves or removes objects settles first, so the file is still where it grew
+    if (growing->size > 0 && (object = lookupOhfi(db, growing->ohfi)) != NULL)
+    {
+        for (object = object->parent; object != NULL; object = object->parent)
+        {
+            object->metadata.size += growing->size;
+        }
+
+        __atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+    }
+
+    growing->ohfi = 0;
+    growing->size = 0;
+}
+
+// applies a size change to the object and every folder above it, the category must be locked
+void adjustSize(struct cma_object *object, long long delta)
+{
+    struct cma_database *db = currentDatabase();
+
+    settleSize(db, object->category);
+
+    // the file itself may have changed too, even if its size did not
+    if (isPrinted(object))
+    {
+        resizeObject(db, object, object->metadata.size + delta);
+        object = object->parent;
+    }
+    else if (object->song != NULL && object->song->tagged)
+    {
+        pthread_mutex_lock(&db->table_lock);
+        queueSong(db, object->song);
+        pthread_mutex_unlock(&db->table_lock);
+    }
+
+    for (; object != NULL; object = object->parent)
+    {
+        object->metadata.size += delta;
+    }
+
+    __atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+}
+
+// for files received in parts, only the file itself grows with each part
+// the folders above it catch up once, when another file grows or in settleSizes()
+// the category must be locked
+void growObject(struct cma_object *object, unsigned long size)
+{
+    struct cma_database *db = currentDatabase();
+    struct cma_growth *growing = &db->growing[object->category];
+
+    if (size <= object->metadata.size)
+    {
+        return; // a part written over what is already there
+    }
+
+    __atomic_add_fetch(&db->changes, 1, __ATOMIC_SEQ_CST);
+
+    if (growing->ohfi != object->metadata.ohfi)
+    {
+        settleSize(db, object->category);
+        growing->ohfi = object->metadata.ohfi;
+    }
+
+    growing->size += size - object->metadata.size;
+
+    if (isPrinted(object))
+    {
+        resizeObject(db, object, size);
+        return;
+    }
+
+    // one being read now is read again once its size settles, see tagThread()
+    if (object->song != NULL && object->song->tagged)
+    {
+        pthread_mutex_lock(&db->table_lock);
+        queueSong(db, object->song);
+        pthread_mutex_unlock(&db->table_lock);
+    }
+
+    object->metadata.size = size;
+}
+
+// brings the folders of every growing file up to date, takes each category in turn
+void settleSizes(void)
+{
+    struct cma_object *root;
+    int i;
+
+    for (i = 0; i < DATABASE_NUM_ROOTS && (root = lockRoot(i)) != NULL; i++)
+    {
+        settleSize(currentDatabase(), i);
+        unlockCategory(root);
+    }
+}
+
+// for changes on disk made with adjustSize(), which reading a folder uses too
+void countChange(void)
+{
+    __atomic_add_fetch(&currentDatabase()->changes, 1, __ATOMIC_SEQ_CST);
+}
+
+// when a photo or video was made, moves it to the month it now belongs in
+// the category must be locked
+void setObjectTime(struct cma_object *object, time_t time)
+{
+    struct cma_database *db = currentDatabase();
+    int indexed = monthView(db, object) != NULL;
+
+    pthread_mutex_lock(&db->table_lock);
+
+    if (indexed)
+    {
+        unindexMonth(db, object);
+    }
+
+    object->metadata.dateTimeCreated = time;
+
+    if (MASK_SET(object->metadata.dataType, Photo | File))
+    {
+        object->metadata.data.photo.dateTimeOriginal = time;
+    }
+    else if (MASK_SET(object->metadata.dataType, Video | File))
+    {
+        object->metadata.data.video.dateTimeUpdated = time;
+    }
+
+    if (indexed)
+    {
+        indexMonth(db, object);
+    }
+
+    forgetElement(db, object->metadata.ohfi);
+    pthread_mutex_unlock(&db->table_lock);
+    __atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+}
+
+// fills in what the tags of a music file say and moves it to its artist, album and genre
+// the category must be locked
+void setTags(struct cma_object *object, const struct cma_tags *tags)
+{
+    struct cma_database *db = currentDatabase();
+    struct metadata_music *music = &object->metadata.data.music;
+    struct cma_song *song = object->song;
+
+    if (song == NULL)
+    {
+        return; // a playlist
+    }
+
+    pthread_mutex_lock(&db->table_lock);
+    unlinkSong(db, song);
+    music->title = tags->title[0] ? internName(db, tags->title) : music->fileName;
+    music->artist = tags->artist[0] ? internName(db, tags->artist) : music->artist;
+    music->album = tags->album[0] ? internName(db, tags->album) : music->album;
+    song->genre = tags->genre[0] ? internName(db, tags->genre) : song->genre;
+
+    // anything else keeps the one the file was given, the Vita only knows its own codec types
+    if (tags->codecType != 0)
+    {
+        music->tracks->data.track_audio.codecType = tags->codecType;
+    }
+
+    music->tracks->data.track_audio.bitrate = tags->bitrate;
+    song->tagged = 1;
+    linkSong(db, song);
+    forgetElement(db, object->metadata.ohfi);
+    pthread_mutex_unlock(&db->table_lock);
+    __atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+}
+
+// takes the next music file whose tags are to be read, 0 if there are none
+int nextUntagged(void)
+{
+    struct cma_database *db = pinDatabase();
+    int ohfi = 0;
+
+    if (db != NULL)
+    {
+        pthread_mutex_lock(&db->table_lock);
+
+        if (db->untagged_head < db->untagged_count)
+        {
+            ohfi = db->untagged[db->untagged_head++];
+        }
+
+        if (db->untagged_head == db->untagged_count)
+        {
+            db->untagged_head = 0;
+            db->untagged_count = 0;
+        }
+
+        pthread_mutex_unlock(&db->table_lock);
+    }
+
+    unpinDatabase();
+    return ohfi;
+}
+
+// the size is added to the folders above, like removeFromDatabase() takes it off
+// the time is the one the file was made, photos and videos are listed under its month
+struct cma_object *addToDatabase(struct cma_object *root, const char *name, size_t size, const enum DataType type,
+                                 time_t time)
+{
+    lockCategory(root);
+    // a folder that is read later would get the new object twice
+    expandObject(root);
+    struct cma_database *db = currentDatabase();
+    pthread_mutex_lock(&db->table_lock);
+    struct cma_object *current = newObject(db, root, name, size, type, time);
+    pthread_mutex_unlock(&db->table_lock);
+    linkChild(root, current);
+    adjustSize(root, size);
+    __atomic_add_fetch(&db->changes, 1, __ATOMIC_SEQ_CST);
+    unlockCategory(root);
+    return current;
+}
+
+static int compareEntries(const void *a, const void *b)
+{
+    return strcmp((*(struct cma_entry * const *)a)->name, (*(struct cma_entry * const *)b)->name);
+}
+
+// merges the entries into the children of parent in one pass, entries are left in the caller's order
+int addEntriesToDatabase(struct cma_object *parent, struct cma_entry *entries, int count)
+{
+    struct cma_object **p_next = &parent->first_child;
+    struct cma_entry **sorted;
+    int i;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    sorted = malloc(count * sizeof(struct cma_entry *));
+
+    for (i = 0; i < count; i++)
+    {
+        sorted[i] = &entries[i];
+    }
+
+    qsort(sorted, count, sizeof(struct cma_entry *), compareEntries);
+    lockCategory(parent);
+    expandObject(parent);
+    struct cma_database *db = currentDatabase();
+
+    // appending to the end is the common case
+    if (parent->last_child != NULL && strcmp(parent->last_child->metadata.name, sorted[0]->name) <= 0)
+    {
+        p_next = &parent->last_child->next_sibling;
+    }
+
+    // the whole batch under one lock
+    pthread_mutex_lock(&db->table_lock);
+
+    for (i = 0; i < count; i++)
+    {
+        sorted[i]->object = newObject(db, parent, sorted[i]->name, sorted[i]->size, sorted[i]->type, sorted[i]->time);
+        p_next = insertChild(parent, p_next, sorted[i]->object);
+    }
+
+    pthread_mutex_unlock(&db->table_lock);
+    __atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+    unlockCategory(parent);
+    free(sorted);
+    return count;
+}
+
+// only used while the database is being built
+void createFilter(struct cma_object *dirobject, metadata_t *output, const char *name, int type)
+{
+    struct cma_database *db = currentDatabase();
+    struct cma_object *old = db->previous != NULL ? lookupOhfi(db->previous, dirobject->metadata.ohfi) : NULL;
+    int index = output - dirobject->filters;
+    output->ohfiParent = dirobject->metadata.ohfi;
+    // filters are always created in the same order, so they can keep the old OHFIs too
+    output->ohfi = old != NULL && index < old->num_filters ? old->filters[index].ohfi
+                   : __atomic_fetch_add(&g_ohfi_count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&db->table_lock);
+    output->name = internName(db, name);
+    output->path = internName(db, "");
+    output->type = type;
+    output->dateTimeCreated = 0;
+    output->size = 0;
+    output->dataType = Folder | Special;
+    output->next_metadata = NULL;
+    registerObject(db, output->ohfi, dirobject);
+    pthread_mutex_unlock(&db->table_lock);
+}
+
+// takes the object and everything under it out of the indexes and frees it, the table lock must be held
+// only the subtree is visited, children go before their parent so nothing freed is read again
+static void removeTree(struct cma_database *db, struct cma_object *top)
+{
+    struct cma_object *object = top;
+    struct cma_object *next;
+
+    for (;;)
+    {
+        while (object->first_child != NULL)
+        {
+            object = object->first_child;
+        }
+
+        if (object == top)
+        {
+            next = NULL;
+        }
+        else
+        {
+            // the parent is left with the rest of its children, and with none once we get back to it
+            object->parent->first_child = object->next_sibling;
+            next = object->next_sibling != NULL ? object->next_sibling : object->parent;
+        }
+
+        unregisterObject(db, object->metadata.ohfi);
+        unhashObject(db, object);
+        removeFromColumn(db, object);
+
+        if (isPrinted(object))
+        {
+            unprintObject(db, object);
+        }
+
+        if (MASK_SET(object->metadata.dataType, Music | File))
+        {
+            unindexSong(db, object);
+        }
+        else if (monthView(db, object) != NULL)
+        {
+            unindexMonth(db, object);
+        }
+
+        freeCMAObject(db, object);
+
+        if (next == NULL)
+        {
+            break;
+        }
+
+        object = next;
+    }
+}
+
+// removes the object and everything under it, the folders above it lose its size
+void removeFromDatabase(int ohfi)
+{
+    struct cma_object *object = lockObject(ohfi);
+    struct cma_object *locked = object;
+    struct cma_object *parent;
+    struct cma_database *db = currentDatabase();
+
+    // master objects and filters cannot be removed
+    if (object != NULL && object->metadata.ohfi == ohfi && object->parent != NULL)
+    {
+        // the object can be reused by another category once it is freed, the parent is in the same one
+        locked = object->parent;
+        settleSize(db, object->category);
+        unlinkChild(object);
+
+        for (parent = object->parent; parent != NULL; parent = parent->parent)
+        {
+            parent->metadata.size -= object->metadata.size;
+        }
+
+        pthread_mutex_lock(&db->table_lock);
+        removeTree(db, object);
+        pthread_mutex_unlock(&db->table_lock);
+        compactColumn(&db->columns[locked->category]);
+        __atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&db->changes, 1, __ATOMIC_SEQ_CST);
+    }
+
+    unlockObject(locked);
+}
+
+// nothing under the object stores its path, so only the object itself changes
+void renameRootEntry(struct cma_object *object, const char *newname)
+{
+    lockCategory(object);
+    struct cma_database *db = currentDatabase();
+    pthread_mutex_lock(&db->table_lock);
+    unhashObject(db, object);
+    setObjectName(object, internName(db, newname));
+    hashObject(db, object);
+    forgetElement(db, object->metadata.ohfi);
+    pthread_mutex_unlock(&db->table_lock);
+    __atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&db->changes, 1, __ATOMIC_SEQ_CST);
+
+    if (object->parent != NULL)
+    {
+        // move it to its new place among its siblings
+        unlinkChild(object);
+        linkChild(object->parent, object);
+    }
+
+    unlockCategory(object);
+}
+
+// moves the object under another folder of the same category and renames it, it keeps its OHFI
+// nothing under it changes, children only know their parent
+// returns -1 if the folder is in another category or under the object itself
+int moveObject(struct cma_object *object, struct cma_object *parent, const char *newname)
+{
+    struct cma_object *folder;
+
+    lockCategory(object);
+    folder = parent;
+
+    while (folder != NULL && folder != object)
+    {
+        folder = folder->parent;
+    }
+
+    if (object->parent == NULL || parent->category != object->category || folder != NULL)
+    {
+        unlockCategory(object);
+        return -1;
+    }
+
+    // a folder that is read later would get the object twice
+    expandObject(parent);
+    struct cma_database *db = currentDatabase();
+    settleSize(db, object->category);
+    unlinkChild(object);
+
+    for (folder = object->parent; folder != NULL; folder = folder->parent)
+    {
+        folder->metadata.size -= object->metadata.size;
+    }
+
+    pthread_mutex_lock(&db->table_lock);
+    unhashObject(db, object);
+    object->metadata.ohfiParent = parent->metadata.ohfi;
+    setObjectName(object, internName(db, newname));
+    hashObject(db, object);
+    forgetElement(db, object->metadata.ohfi);
+    pthread_mutex_unlock(&db->table_lock);
+    linkChild(parent, object);
+
+    for (folder = parent; folder != NULL; folder = folder->parent)
+    {
+        folder->metadata.size += object->metadata.size;
+    }
+
+    __atomic_add_fetch(&db->generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&db->changes, 1, __ATOMIC_SEQ_CST);
+    unlockCategory(object);
+    return 0;
+}
+
+// the object is only safe to use while its category is locked, see lockObject()
+struct cma_object *ohfiToObject(int ohfi)
+{
+    struct cma_object *found = NULL;
+    struct cma_database *db = pinDatabase();
+
+    if (db != NULL)
+    {
+        found = lookupOhfi(db, ohfi);
+        __atomic_add_fetch(&g_ohfi_lookups, 1, __ATOMIC_RELAXED);
+    }
+
+    unpinDatabase();
+    return found;
+}
+
+// fills the buffer from the end, walking up to the master object
+static char *buildPath(const struct cma_object *object, char *buffer, size_t size, int absolute)
+{
+    const char *name = object->metadata.name;
+    char *start = buffer + size - 1;
+    size_t len;
+    int slash;
+
+    *start = '\0';
+
+    for (; object->parent != NULL; object = object->parent)
+    {
+        slash = absolute || object->parent->parent != NULL;
+        len = strlen(object->metadata.name);
+
+        if ((size_t)(start - buffer) < len + slash)
+        {
+            LOG(LERROR, "Path for %s is too long.\n", name);
+            buffer[0] = '\0';
+            return buffer;
+        }
+
+        start -= len;
+        memcpy(start, object->metadata.name, len);
+
+        if (slash)
+        {
+            *--start = '/';
+        }
+    }
+
+    if (absolute)
+    {
+        len = strlen(object->root_path);
+
+        if ((size_t)(start - buffer) < len)
+        {
+            LOG(LERROR, "Path for %s is too long.\n", name);
+            buffer[0] = '\0';
+            return buffer;
+        }
+
+        start -= len;
+        memcpy(start, object->root_path, len);
+    }
+
+    memmove(buffer, start, buffer + size - start);
+    return buffer;
+}
+
+// the full path on disk, or an empty string if it does not fit in the buffer
+char *objectPath(const struct cma_object *object, char *buffer, size_t size)
+{
+    lockCategory(object);
+    buildPath(object, buffer, size, 1);
+    unlockCategory(object);
+    return buffer;
+}
+
+// the path under the master object, as the Vita sees it
+char *objectRelativePath(const struct cma_object *object, char *buffer, size_t size)
+{
+    lockCategory(object);
+    buildPath(object, buffer, size, 0);
+    unlockCategory(object);
+    return buffer;
+}
+
+// walks the path one component at a time, each step is a single table lookup
+// the category of start must be locked
+static struct cma_object *resolvePath(struct cma_database *db, struct cma_object *start, const char *path)
+{
+    struct cma_object *object = start;
+    size_t len;
+
+    for (; object != NULL && *path != '\0'; path += len)
+    {
+        if (*path == '/')
+        {
+            len = 1; // skip separators
+            continue;
+        }
+
+        len = strcspn(path, "/");
+        expandObject(object);
+        pthread_mutex_lock(&db->table_lock);
+        object = lookupName(db, object->metadata.ohfi, path, len);
+        pthread_mutex_unlock(&db->table_lock);
+    }
+
+    return object == start ? NULL : object;
+}
+
+// ohfiRoot can be any folder, paths are relative to it
+// ohfiRoot == 0 means look in all lists
+struct cma_object *pathToObject(char *path, int ohfiRoot)
+{
+    struct cma_database *db = pinDatabase();
     // the database is basically an array of cma_objects, so we'll cast it so
-    struct cma_object *db_objects = (struct cma_object *)g_database;
-    int count = sizeof(struct cma_database) / sizeof(struct cma_object);
+    struct cma_object *db_objects = (struct cma_object *)db;
+    struct cma_object *found = NULL;
+    struct cma_object *start;
     int i;
 
-    // loop through all the master objects
-    for (i = 0; i < count; i++)
-    {
-        struct cma_object *next = NULL;
-        struct cma_object *current;
+    __atomic_add_fetch(&g_path_lookups, 1, __ATOMIC_RELAXED);
 
-        for (current = &db_objects[i]; current != NULL; current = next)
+    if (db == NULL)
+    {
+        // nothing to find
+    }
+    else if (ohfiRoot)
+    {
+        start = lockObject(ohfiRoot);
+        found = resolvePath(db, start, path);
+        unlockObject(start);
+    }
+    else
+    {
+        // loop through all the master objects, one category at a time
+        for (i = 0; i < DATABASE_NUM_ROOTS && found == NULL; i++)
         {
-            next = current->next_object;
-            freeCMAObject(current);
+            lockCategory(&db_objects[i]);
+            found = resolvePath(db, &db_objects[i], path);
+            unlockCategory(&db_objects[i]);
         }
     }
 
-    pthread_mutex_unlock(&g_database_lock);
-
-    pthread_mutex_destroy(&g_database_lock);
-    pthread_mutexattr_destroy(&g_database_lock_attr);
-    free(g_database);
-    g_database = NULL;
+    unpinDatabase();
+    return found;
 }
 
-inline void lockDatabase()
+// reads the first bytes of a file, returns their hash or 0 if it cannot be read
+static unsigned int readPrint(const char *path, unsigned char **p_data, unsigned int len)
 {
-    pthread_mutex_lock(&g_database_lock);
-}
+    if (len > 0 && readFileToBuffer(path, 0, p_data, &len) < 0)
+    {
+        return 0;
+    }
 
-inline void unlockDatabase()
-{
-    pthread_mutex_unlock(&g_database_lock);
+    return contentHash((const char *)*p_data, len);
 }
 
-void addEntriesForDirectory(struct cma_object *current, int parent_ohfi)
+// finds an app, save or backup file with the same size and first bytes, whatever it is called
+// returns its OHFI or 0, only files of that size are read and the hash keeps the others from being read again
+// the files are read with nothing locked, so the caller must not hold a lock either
+int findByContent(unsigned long size, const char *data, unsigned int len)
 {
-    pthread_mutex_lock(&g_database_lock);
-    struct cma_object *last = current;
-    char fullpath[PATH_MAX];
-    DIR *dirp;
-    struct dirent *entry;
-    struct stat statbuf;
-    size_t fpath_pos;
-
-    fullpath[0] = '\0';
-    sprintf(fullpath, "%s/", last->path);
-    fpath_pos = strlen(fullpath);
+    struct cma_database *db = pinDatabase();
+    struct cma_object *entry;
+    char path[PATH_MAX];
+    unsigned char *first;
+    unsigned int hash = contentHash(data, len);
+    unsigned int print;
+    int *candidates = NULL;
+    int count = 0;
+    int capacity = 0;
+    int found = 0;
+    int valid;
+    int matched;
+    int i;
 
-    if ((dirp = opendir(fullpath)) == NULL)
+    // the hash only means something if it covers as much as we read
+    if (db == NULL || len != (size < PRINT_BYTES ? size : PRINT_BYTES))
     {
-        pthread_mutex_unlock(&g_database_lock);
-        return;
+        unpinDatabase();
+        return 0;
     }
 
-    unsigned long totalSize = 0;
+    pthread_mutex_lock(&db->table_lock);
 
-    while ((entry = readdir(dirp)) != NULL)
+    if (db->print_table_size > 0)
     {
-        if (entry->d_name[0] == '.')
+        entry = db->print_table[sizeHash(size) & (db->print_table_size - 1)];
+
+        for (; entry != NULL; entry = entry->next_print)
         {
-            continue; // ignore hidden folders and ., ..
+            // a matching hash is only a hint, the bytes are compared below
+            if (entry->metadata.size == size && (entry->print == hash || entry->print == 0))
+            {
+                if (count == capacity)
+                {
+                    capacity = capacity ? capacity * 2 : 16;
+                    candidates = realloc(candidates, capacity * sizeof(int));
+                }
+
+                candidates[count++] = entry->metadata.ohfi;
+            }
         }
+    }
 
-        strcat(fullpath, entry->d_name);
+    pthread_mutex_unlock(&db->table_lock);
 
-        if (stat(fullpath, &statbuf) != 0)
+    for (i = 0; i < count && found == 0; i++)
+    {
+        // anything could have changed since the table was unlocked
+        if ((entry = lockObject(candidates[i])) == NULL)
         {
             continue;
         }
 
-        current = addToDatabase(last, entry->d_name, statbuf.st_size, S_ISDIR(statbuf.st_mode) ? Folder : File);
+        if ((valid = entry->metadata.ohfi == candidates[i] && entry->metadata.size == size))
+        {
+            objectPath(entry, path, sizeof(path));
+        }
+
+        unlockObject(entry);
 
-        if (current->metadata.dataType & Folder)
+        if (!valid)
         {
-            addEntriesForDirectory(current, current->metadata.ohfi);
+            continue;
         }
 
-        totalSize += current->metadata.size;
+        // the Vita can go on browsing while we wait on the disk
+        first = NULL;
+        print = readPrint(path, &first, len);
+        matched = print == hash && (len == 0 || memcmp(first, data, len) == 0);
+        free(first);
+
+        // only keep what was read if the file is still the one we read
+        if ((entry = lockObject(candidates[i])) != NULL && entry->metadata.ohfi == candidates[i]
+                && entry->metadata.size == size)
+        {
+            pthread_mutex_lock(&db->table_lock);
+            entry->print = print;
+            pthread_mutex_unlock(&db->table_lock);
+            found = matched ? candidates[i] : 0;
+        }
 
-        fullpath[fpath_pos] = '\0';
+        unlockObject(entry);
     }
 
-    last->metadata.size += totalSize;
-    closedir(dirp);
-    pthread_mutex_unlock(&g_database_lock);
+    free(candidates);
+    unpinDatabase();
+    return found;
 }
 
-struct cma_object *addToDatabase(struct cma_object *root, const char *name, size_t size, const enum DataType type)
+// pre-order walk of the tree under top, returns NULL once it is done
+struct cma_object *nextInTree(struct cma_object *object, const struct cma_object *top)
 {
-    pthread_mutex_lock(&g_database_lock);
-    struct cma_object *current = malloc(sizeof(struct cma_object));
-    memset(current, 0, sizeof(struct cma_object));
-    current->metadata.name = strdup(name);
-    current->metadata.ohfiParent = root->metadata.ohfi;
-    current->metadata.ohfi = g_ohfi_count++;
-    current->metadata.type = VITA_DIR_TYPE_MASK_REGULAR; // ignored for files
-    current->metadata.dateTimeCreated = 0; // TODO: allow for time created
-    current->metadata.size = size;
-    current->metadata.dataType = type | (root->metadata.dataType & ~Folder); // get parent attributes except Folder
-
-    // create additional metadata
-    // TODO: Read real metadata for files
-    if (MASK_SET(current->metadata.dataType, SaveData | Folder))
+    if (object->first_child != NULL)
     {
-        current->metadata.data.saveData.title = strdup(name);
-        current->metadata.data.saveData.detail = strdup("");
-        current->metadata.data.saveData.dirName = strdup(name);
-        current->metadata.data.saveData.savedataTitle = strdup("");
-        current->metadata.data.saveData.dateTimeUpdated = 0;
-        current->metadata.data.saveData.statusType = 1;
+        return object->first_child;
     }
-    else if (MASK_SET(current->metadata.dataType, Photo | File))
+
+    for (; object != top; object = object->parent)
     {
-        current->metadata.data.photo.title = strdup(name);
-        current->metadata.data.photo.fileName = strdup(name);
-        current->metadata.data.photo.fileFormatType = 28; // working
-        current->metadata.data.photo.statusType = 1;
-        current->metadata.data.photo.dateTimeOriginal = 0;
-        current->metadata.data.photo.numTracks = 1;
-        current->metadata.data.photo.tracks = malloc(sizeof(struct media_track));
-        memset(current->metadata.data.photo.tracks, 0, sizeof(struct media_track));
-        current->metadata.data.photo.tracks->type = VITA_TRACK_TYPE_PHOTO;
-        current->metadata.data.photo.tracks->data.track_photo.codecType = 17; // JPEG?
+        if (object->next_sibling != NULL)
+        {
+            return object->next_sibling;
+        }
     }
-    else if (MASK_SET(current->metadata.dataType, Music | File))
+
+    return NULL;
+}
+
+// the low bits of a directory type say what is listed, the rest are flags
+#define DIR_TYPE_VIEW_MASK 0xf
+
+// the dataType bits an object needs to be listed by a filter, 0 if the filter lists nothing
+static unsigned int filterMask(int type)
+{
+    unsigned int mask;
+
+    if (MASK_SET(type, VITA_DIR_TYPE_MASK_PHOTO))
     {
-        current->metadata.data.music.title = strdup(name);
-        current->metadata.data.music.fileName = strdup(name);;
-        current->metadata.data.music.fileFormatType = 20;
-        current->metadata.data.music.statusType = 1;
-        current->metadata.data.music.album = strdup(root->metadata.name ? root->metadata.name : "");
-        current->metadata.data.music.artist = strdup("");
-        current->metadata.data.music.numTracks = 1;
-        current->metadata.data.music.tracks = malloc(sizeof(struct media_track));
-        memset(current->metadata.data.music.tracks, 0, sizeof(struct media_track));
-        current->metadata.data.music.tracks->type = VITA_TRACK_TYPE_AUDIO;
-        current->metadata.data.music.tracks->data.track_photo.codecType = 12; // MP3?
+        mask = Photo;
     }
-    else if (MASK_SET(current->metadata.dataType, Video | File))
+    else if (MASK_SET(type, VITA_DIR_TYPE_MASK_VIDEO))
     {
-        current->metadata.data.video.title = strdup(name);
-        current->metadata.data.video.explanation = strdup("");
-        current->metadata.data.video.fileName = strdup(name);
-        current->metadata.data.video.copyright = strdup("");
-        current->metadata.data.video.dateTimeUpdated = 0;
-        current->metadata.data.video.statusType = 1;
-        current->metadata.data.video.fileFormatType = 1;
-        current->metadata.data.video.parentalLevel = 0;
-        current->metadata.data.video.numTracks = 1;
-        current->metadata.data.video.tracks = malloc(sizeof(struct media_track));
-        memset(current->metadata.data.video.tracks, 0, sizeof(struct media_track));
-        current->metadata.data.video.tracks->type = VITA_TRACK_TYPE_VIDEO;
-        current->metadata.data.video.tracks->data.track_video.codecType = 3; // this codec is working
+        mask = Video;
     }
-
-    asprintf(&current->path, "%s/%s", root->path, name);
-
-    if (root->metadata.path == NULL)
+    else if (MASK_SET(type, VITA_DIR_TYPE_MASK_MUSIC))
     {
-        current->metadata.path = strdup(name);
+        mask = Music;
     }
     else
     {
-        asprintf(&current->metadata.path, "%s/%s", root->metadata.path, name);
+        return 0;
     }
 
-    while (root->next_object != NULL)
+    if ((type & VITA_DIR_TYPE_MASK_ALL) || (type & DIR_TYPE_VIEW_MASK) == VITA_DIR_TYPE_MASK_SONGS)
     {
-        root = root->next_object;
+        mask |= File;
     }
 
-    root->next_object = current;
-    pthread_mutex_unlock(&g_database_lock);
-    return current;
+    return mask;
 }
 
-void createFilter(struct cma_object *dirobject, metadata_t *output, const char *name, int type)
+static void appendToList(struct cma_list *list, const metadata_t *meta)
 {
-    pthread_mutex_lock(&g_database_lock);
-    output->ohfiParent = dirobject->metadata.ohfi;
-    output->ohfi = g_ohfi_count++;
-    output->name = strdup(name);
-    output->path = strdup(dirobject->metadata.path ? dirobject->metadata.path : "");
-    output->type = type;
-    output->dateTimeCreated = 0;
-    output->size = 0;
-    output->dataType = Folder | Special;
-    output->next_metadata = NULL;
-    pthread_mutex_unlock(&g_database_lock);
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, list->capacity * sizeof(metadata_t *));
+    }
+
+    list->items[list->count++] = meta;
 }
 
-void removeFromDatabase(int ohfi, struct cma_object *start)
+// four types at a time, GCC makes SSE2 or NEON instructions of it where there are any
+typedef unsigned int type_vector __attribute__((vector_size(16)));
+
+// lists the objects in the column that have all the bits of mask
+// a block of 64 is turned into a bitmap first, with one mask and compare for every four types
+static void selectObjects(const struct cma_column *column, unsigned int mask, struct cma_list *list)
 {
-    pthread_mutex_lock(&g_database_lock);
-    struct cma_object **p_object;
-    struct cma_object **p_toFree;
-    struct cma_object *prev = NULL;
+    const type_vector masks = {mask, mask, mask, mask};
+    const type_vector lanes = {1, 2, 4, 8};
+    type_vector types;
+    type_vector hits;
+    uint64_t bits;
+    int base;
+    int count;
+    int i;
 
-    for (p_object = &start; *p_object != NULL; p_object = &(*p_object)->next_object)
+    for (base = 0; base < column->count; base += 64)
     {
-        if ((*p_object)->metadata.ohfi == ohfi)
+        count = column->count - base < 64 ? column->count - base : 64;
+        bits = 0;
+
+        for (i = 0; i + 4 <= count; i += 4)
         {
-            p_toFree = p_object;
+            memcpy(&types, &column->types[base + i], sizeof(types)); // the column is not aligned to 16
+            hits = (type_vector)((types & masks) == masks) & lanes;
+            bits |= (uint64_t)(hits[0] | hits[1] | hits[2] | hits[3]) << i;
         }
 
-        if ((*p_object)->metadata.ohfiParent == ohfi)
+        for (; i < count; i++)
         {
-            // we know that the children must be after the parent in the linked list
-            // for this to be a valid database
-            assert(prev != NULL);
-            removeFromDatabase((*p_object)->metadata.ohfi, prev);
-            p_object = &prev; // back up one since *p_object is freed
+            bits |= (uint64_t)((column->types[base + i] & mask) == mask) << i;
         }
 
-        prev = *p_object; // store "prevous" object
+        for (; bits != 0; bits &= bits - 1)
+        {
+            appendToList(list, &column->objects[base + __builtin_ctzll(bits)]->metadata);
+        }
     }
-
-    // do this at the end so we can still see each node
-    prev = *p_toFree;
-    *p_toFree = prev->next_object;
-    pthread_mutex_unlock(&g_database_lock);
-    freeCMAObject(prev);
 }
 
-void renameRootEntry(struct cma_object *object, const char *name, const char *newname)
+// follows one line of a playlist from the folder the playlist is in
+// the music category must be locked
+static struct cma_object *resolveEntry(struct cma_database *db, struct cma_object *start, const char *path)
 {
-    pthread_mutex_lock(&g_database_lock);
-    struct cma_object *temp;
-    char *origPath = object->path;
-    char *origRelPath = object->metadata.path;
-    char *origName = object->metadata.name;
+    struct cma_object *object = start;
+    size_t len;
 
-    if (name == NULL)
+    for (; object != NULL && *path != '\0'; path += len)
     {
-        name = origName;
-    }
+        // playlists made on Windows use backslashes
+        if (*path == '/' || *path == '\\')
+        {
+            len = 1;
+            continue;
+        }
 
-    object->metadata.name = strreplace(origName, name, newname);
-    object->metadata.path = strreplace(origRelPath, name, newname);
-    object->path = strreplace(origPath, origRelPath, object->metadata.path);
+        len = strcspn(path, "/\\");
 
-    for (temp = object; temp != NULL; temp = temp->next_object)
-    {
-        // rename all child objects
-        if (temp->metadata.ohfiParent == object->metadata.ohfi)
+        if (len == 2 && strncmp(path, "..", 2) == 0)
         {
-            char *nname;
-            char *nnewname;
-            asprintf(&nname, "%s/%s", origRelPath, temp->metadata.name);
-            asprintf(&nnewname, "%s/%s", object->metadata.path, temp->metadata.name);
-            renameRootEntry(temp, nname, nnewname);
-            free(nname);
-            free(nnewname);
+            object = object->parent;
+        }
+        else if (len != 1 || *path != '.')
+        {
+            pthread_mutex_lock(&db->table_lock);
+            object = lookupName(db, object->metadata.ohfi, path, len);
+            pthread_mutex_unlock(&db->table_lock);
         }
     }
 
-    free(origPath);
-    free(origRelPath);
-    free(origName);
-    pthread_mutex_unlock(&g_database_lock);
+    return object;
 }
 
-struct cma_object *ohfiToObject(int ohfi)
+// lists the songs in a playlist that are in the database, read from the file every time
+// paths are relative to the playlist, or absolute under the music folder
+static void listPlaylist(struct cma_database *db, const struct cma_group *group, struct cma_list *list)
 {
-    pthread_mutex_lock(&g_database_lock);
-    // the database is basically an array of cma_objects, so we'll cast it so
-    struct cma_object *db_objects = (struct cma_object *)g_database;
-    int count = sizeof(struct cma_database) / sizeof(struct cma_object);
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    const char *root = db->music.root_path;
+    size_t rootlen = strlen(root);
     struct cma_object *object;
-    struct cma_object *found = NULL;
-    int i;
-    int j;
+    char *entry;
+    FILE *fp;
 
-    // loop through all the master objects
-    for (i = 0; i < count; i++)
+    if ((fp = fopen(objectPath(group->playlist, path, sizeof(path)), "r")) == NULL)
+    {
+        LOG(LVERBOSE, "Cannot read playlist %s\n", path);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
     {
-        // first element in loop is the master object, the ones after are it's children
-        for (object = &db_objects[i]; object != NULL; object = object->next_object)
+        line[strcspn(line, "\r\n")] = '\0';
+        // m3u8 files can start with a byte order mark
+        entry = strncmp(line, "\xef\xbb\xbf", 3) == 0 ? line + 3 : line;
+
+        if (entry[0] == '#' || entry[0] == '\0')
         {
-            if (object->metadata.ohfi == ohfi)
-            {
-                found = object;
-                break;
-            }
+            continue;
+        }
 
-            if (object->num_filters > 0)
-            {
-                for (j = 0; j < object->num_filters; j++)
-                {
-                    if (object->filters[j].ohfi == ohfi)
-                    {
-                        found = object;
-                        break;
-                    }
-                }
-            }
+        if (entry[0] != '/')
+        {
+            object = resolveEntry(db, group->playlist->parent, entry);
+        }
+        else if (strncmp(entry, root, rootlen) == 0 && entry[rootlen] == '/')
+        {
+            object = resolveEntry(db, &db->music, entry + rootlen);
+        }
+        else
+        {
+            continue; // not in the music folder
         }
 
-        if (found)
+        if (object != NULL && MASK_SET(object->metadata.dataType, Music | File))
         {
-            break;
+            appendToList(list, &object->metadata);
         }
     }
 
-    pthread_mutex_unlock(&g_database_lock);
-    return found;
+    fclose(fp);
 }
 
-// ohfiRoot == 0 means look in all lists
-struct cma_object *pathToObject(char *path, int ohfiRoot)
+// lists a view from its groups, the category of parent must be locked
+// group is what is being listed, NULL for the filters themselves
+static void listGroups(struct cma_database *db, const struct cma_object *parent, const struct cma_group *group,
+                       int type, struct cma_list *list)
 {
-    pthread_mutex_lock(&g_database_lock);
-    // the database is basically an array of cma_objects, so we'll cast it so
-    struct cma_object *db_objects = (struct cma_object *)g_database;
-    int count = sizeof(struct cma_database) / sizeof(struct cma_object);
-    struct cma_object *object;
-    struct cma_object *found = NULL;
+    int view = type & DIR_TYPE_VIEW_MASK;
+    const struct cma_group *member;
+    const struct cma_group *album;
+    const struct cma_song *song;
+    int link = view == VITA_DIR_TYPE_MASK_GENRES ? SONG_GENRE : SONG_ALBUM;
     int i;
 
-    // loop through all the master objects
-    for (i = 0; i < count; i++)
+    if (group == NULL)
     {
-        if (ohfiRoot && db_objects[i].metadata.ohfi != ohfiRoot)
-        {
-            continue;
-        }
-
-        // first element in loop is the master object, the ones after are it's children
-        for (object = db_objects[i].next_object; object != NULL; object = object->next_object)
+        if (view == VITA_DIR_TYPE_MASK_ALBUMS)
         {
-            if (strcmp(object->metadata.path, path) == 0)
+            for (member = db->artists.first_member; member != NULL; member = member->next_member)
             {
-                found = object;
-                break;
+                for (album = member->first_member; album != NULL; album = album->next_member)
+                {
+                    appendToList(list, &album->metadata);
+                }
             }
+
+            return;
         }
 
-        if (found)
+        if (view == VITA_DIR_TYPE_MASK_MONTH)
         {
-            break;
+            group = parent == &db->photos ? &db->photo_months : &db->video_months;
+        }
+        else
+        {
+            group = view == VITA_DIR_TYPE_MASK_ARTISTS ? &db->artists
+                    : view == VITA_DIR_TYPE_MASK_GENRES ? &db->genres : &db->playlists;
         }
     }
-
-    pthread_mutex_unlock(&g_database_lock);
-    return found;
-}
-
-static int acceptFilteredObject(const struct cma_object *parent, const struct cma_object *current, int type)
-{
-    int result = 0;
-    pthread_mutex_lock(&g_database_lock);
-
-    if (MASK_SET(type, VITA_DIR_TYPE_MASK_PHOTO))
-    {
-        result = (current->metadata.dataType & Photo);
-    }
-    else if (MASK_SET(type, VITA_DIR_TYPE_MASK_VIDEO))
+    else if (view == VITA_DIR_TYPE_MASK_PLAYLISTS)
     {
-        result = (current->metadata.dataType & Video);
+        listPlaylist(db, group, list);
+        return;
     }
-    else if (MASK_SET(type, VITA_DIR_TYPE_MASK_MUSIC))
+
+    // the groups in a view or the albums of an artist
+    for (member = group->first_member; member != NULL; member = member->next_member)
     {
-        result = (current->metadata.dataType & Music);
+        appendToList(list, &member->metadata);
     }
 
-    if (type & (VITA_DIR_TYPE_MASK_ALL | VITA_DIR_TYPE_MASK_SONGS))
+    for (song = group->first_song; song != NULL; song = song->next[link])
     {
-        result = result && (current->metadata.dataType & File);
+        appendToList(list, &song->object->metadata);
     }
-    else if (type & (VITA_DIR_TYPE_MASK_REGULAR))
+
+    for (i = 0; i < group->count && group->objects != NULL; i++)
     {
-        result = (parent->metadata.ohfi == current->metadata.ohfiParent);
+        appendToList(list, &group->objects[i]->metadata);
     }
-
-    // TODO: Support other filter types
-    pthread_mutex_unlock(&g_database_lock);
-    return result;
 }
 
-static int getFilters(const struct cma_object *parent, metadata_t **p_head)
+// the category of parent must be locked, group is set if a music group is listed
+static void listObjects(struct cma_object *parent, const struct cma_group *group, int type, struct cma_list *list)
 {
-    int numObjects = 0;
-    pthread_mutex_lock(&g_database_lock);
-    numObjects = parent->num_filters;
+    struct cma_database *db = currentDatabase();
+    struct cma_object *object;
+    unsigned int mask = filterMask(type);
+    int view = type & DIR_TYPE_VIEW_MASK;
 
-    for (int i = 0; i < numObjects; i++)
+    list->count = 0;
+
+    if ((type & VITA_DIR_TYPE_MASK_ALL) || view == VITA_DIR_TYPE_MASK_SONGS)
     {
-        parent->filters[i].next_metadata = &parent->filters[i+1];
-    }
+        if (mask == 0)
+        {
+            return; // nothing we know how to filter on
+        }
 
-    parent->filters[numObjects-1].next_metadata = NULL;
+        // everything in the category
+        completeObject(parent);
+
+        if (parent->parent == NULL)
+        {
+            selectObjects(&db->columns[parent->category], mask, list);
+            return;
+        }
 
-    if (p_head != NULL)
+        for (object = parent->first_child; object != NULL; object = nextInTree(object, parent))
+        {
+            if ((object->metadata.dataType & mask) == mask)
+            {
+                appendToList(list, &object->metadata);
+            }
+        }
+    }
+    else if ((MASK_SET(type, VITA_DIR_TYPE_MASK_MUSIC) && view >= VITA_DIR_TYPE_MASK_ARTISTS
+              && view <= VITA_DIR_TYPE_MASK_PLAYLISTS)
+             || (view == VITA_DIR_TYPE_MASK_MONTH && (parent == &db->photos || parent == &db->videos)))
     {
-        *p_head = parent->filters;
+        // the groups are only complete once everything has been read
+        completeObject(parent);
+        listGroups(db, parent, group, type, list);
     }
+    else if (view == VITA_DIR_TYPE_MASK_REGULAR)
+    {
+        // only the direct children, folders not read yet are listed with what is known of their size
+        expandObject(parent);
 
-    pthread_mutex_unlock(&g_database_lock);
-    return numObjects;
+        for (object = parent->first_child; object != NULL; object = object->next_sibling)
+        {
+            appendToList(list, &object->metadata);
+        }
+    }
 }
 
-int filterObjects(int ohfiParent, metadata_t **p_head)
+// lists what is under ohfiParent into list, which can be reused, returns the count
+// list can be NULL to only count, otherwise the list is only good while the category of ohfiParent is locked
+int filterObjects(int ohfiParent, struct cma_list *list)
 {
-    pthread_mutex_lock(&g_database_lock);
-    int numObjects = 0;
-    metadata_t temp = {0};
-    struct cma_object *db_objects = (struct cma_object *)g_database;
-    struct cma_object *object;
-    struct cma_object *parent = ohfiToObject(ohfiParent);
+    struct cma_object *parent = lockObject(ohfiParent);
+    struct cma_database *db = currentDatabase();
+    struct cma_group *group = NULL;
+    struct cma_result *result;
+    int count;
+    int j;
 
     if (parent == NULL)
     {
-        pthread_mutex_unlock(&g_database_lock);
+        if (list != NULL)
+        {
+            list->count = 0;
+        }
+
         return 0;
     }
 
     int type = parent->metadata.type;
-    int j;
 
-    if (parent->filters > 0)   // if we have filters
+    if (parent->num_filters > 0)   // if we have filters
     {
         if (ohfiParent == parent->metadata.ohfi)   // if we are looking at root
         {
-            pthread_mutex_unlock(&g_database_lock);
             // return the filter list
-            return getFilters(parent, p_head);
+            count = parent->num_filters;
+
+            if (list != NULL)
+            {
+                list->count = 0;
+
+                for (j = 0; j < count; j++)
+                {
+                    appendToList(list, &parent->filters[j]);
+                }
+            }
+
+            unlockObject(parent);
+            return count;
         }
         else     // we are looking at a filter
         {
@@ -620,38 +2592,172 @@ int filterObjects(int ohfiParent, metadata_t **p_head)
                     break;
                 }
             }
+
+            // or the type of the group
+            if (j == parent->num_filters && (group = ohfiToGroup(db, ohfiParent)) != NULL)
+            {
+                type = group->metadata.type;
+            }
         }
     }
 
-    metadata_t *tail = &temp;
-    int count = sizeof(struct cma_database) / sizeof(struct cma_object);
-    int i;
+    // the Vita always asks for the count and then for the same list, so the count keeps what it found
+    // any change to the database bumps the generation, which throws the listing out
+    result = &db->results[parent->category];
 
-    for (i = 0; i < count; i++)
+    if (result->ohfiParent != ohfiParent || result->type != type
+            || result->generation != __atomic_load_n(&db->generation, __ATOMIC_SEQ_CST))
+    {
+        __atomic_add_fetch(&g_listings, 1, __ATOMIC_RELAXED);
+        listObjects(parent, group, type, &result->list);
+        result->ohfiParent = ohfiParent;
+        result->type = type;
+        // after listing, reading folders for the list changes the database too
+        result->generation = __atomic_load_n(&db->generation, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        __atomic_add_fetch(&g_cached_listings, 1, __ATOMIC_RELAXED);
+    }
+
+    count = result->list.count;
+
+    if (list != NULL)
+    {
+        list->count = 0;
+
+        for (j = 0; j < count; j++)
+        {
+            appendToList(list, result->list.items[j]);
+        }
+    }
+
+    unlockObject(parent);
+    return count;
+}
+
+void freeList(struct cma_list *list)
+{
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// the XML for an object or filter in a listing, made the first time it is listed and kept until the object changes
+// the category of the object must be locked
+const metadata_element_t *metadataElement(const metadata_t *meta)
+{
+    struct cma_database *db = pinDatabase();
+    struct cma_xml *xml = NULL;
+    int known = 0;
+
+    if (db != NULL)
     {
-        for (object = &db_objects[i]; object != NULL; object = object->next_object)
+        pthread_mutex_lock(&db->table_lock);
+
+        if ((known = meta->ohfi > 0 && meta->ohfi < db->ohfi_table_size))
         {
-            if (acceptFilteredObject(parent, object, type))
+            // sizes change all the time while files are copied, so they are checked instead of tracked
+            if ((xml = db->xml_table[meta->ohfi]) != NULL && xml->size != meta->size)
             {
-                tail->next_metadata = &object->metadata;
-                tail = tail->next_metadata;
-                numObjects++;
+                forgetElement(db, meta->ohfi);
+                xml = NULL;
             }
         }
 
-        if (numObjects > 0)
+        pthread_mutex_unlock(&db->table_lock);
+    }
+
+    // made without the table lock, nobody else can list this object while we hold its category
+    if (known && xml == NULL)
+    {
+        xml = malloc(sizeof(struct cma_xml));
+        xml->size = meta->size;
+
+        if (VitaMTP_Data_Metadata_Element_To_XML(meta, &xml->element) != 0)
         {
-            break; // quick speedup to prevent looking at all lists
+            free(xml);
+            xml = NULL;
         }
+
+        pthread_mutex_lock(&db->table_lock);
+        db->xml_table[meta->ohfi] = xml;
+        pthread_mutex_unlock(&db->table_lock);
+    }
+
+    unpinDatabase();
+    return xml != NULL ? &xml->element : NULL;
+}
+
+static size_t objectBytes(const struct cma_object *object)
+{
+    const metadata_t *meta = &object->metadata;
+    size_t size = sizeof(struct cma_object);
+
+    // same as freeCMAObject()
+    if (MASK_SET(meta->dataType, Photo | File) || MASK_SET(meta->dataType, Music | File)
+            || MASK_SET(meta->dataType, Video | File))
+    {
+        size += sizeof(struct media_track);
     }
 
-    tail->next_metadata = NULL;
+    return size;
+}
+
+// walks the whole database, one category at a time, so it is not meant to be called often
+void getDatabaseStats(struct cma_stats *stats)
+{
+    struct cma_database *db = pinDatabase();
+    struct cma_object *root;
+    struct cma_object *object;
+    int i;
+
+    memset(stats, 0, sizeof(struct cma_stats));
+
+    for (i = 0; db != NULL && i < DATABASE_NUM_ROOTS && (root = lockRoot(i)) != NULL; i++)
+    {
+        for (object = root->first_child; object != NULL; object = nextInTree(object, root))
+        {
+            stats->objects[i]++;
+            stats->folders[i] += (object->metadata.dataType & Folder) != 0;
+            stats->object_bytes += objectBytes(object);
+        }
+
+        stats->filter_bytes += root->num_filters * sizeof(metadata_t);
+        stats->table_bytes += db->results[i].list.capacity * sizeof(metadata_t *)
+                              + db->columns[i].capacity * (sizeof(unsigned int) + sizeof(struct cma_object *));
+        unlockCategory(root);
+    }
 
-    if (p_head != NULL)
+    if (db != NULL)
     {
-        *p_head = temp.next_metadata;
+        pthread_mutex_lock(&db->table_lock);
+
+        for (i = 0; i < db->intern_table_size; i++)
+        {
+            stats->string_bytes += db->intern_table[i] != NULL ? strlen(db->intern_table[i]) + 1 : 0;
+        }
+
+        for (i = 0; i < db->ohfi_table_size; i++)
+        {
+            stats->xml_bytes += db->xml_table[i] != NULL ? sizeof(struct cma_xml) + db->xml_table[i]->element.len : 0;
+        }
+
+        stats->table_bytes += db->ohfi_table_size * (sizeof(struct cma_object *) + sizeof(struct cma_xml *))
+                              + (db->name_table_size + db->print_table_size) * sizeof(struct cma_object *)
+                              + db->intern_table_size * sizeof(char *) + db->untagged_capacity * sizeof(int);
+        stats->arena_bytes = db->arena.size;
+        pthread_mutex_unlock(&db->table_lock);
+        stats->build_time = db->build_time;
+        stats->build_seconds = db->build_seconds;
     }
 
-    pthread_mutex_unlock(&g_database_lock);
-    return numObjects;
+    stats->ohfi_lookups = __atomic_load_n(&g_ohfi_lookups, __ATOMIC_RELAXED);
+    stats->path_lookups = __atomic_load_n(&g_path_lookups, __ATOMIC_RELAXED);
+    stats->name_lookups = __atomic_load_n(&g_name_lookups, __ATOMIC_RELAXED);
+    stats->name_probes = __atomic_load_n(&g_name_probes, __ATOMIC_RELAXED);
+    stats->listings = __atomic_load_n(&g_listings, __ATOMIC_RELAXED);
+    stats->cached_listings = __atomic_load_n(&g_cached_listings, __ATOMIC_RELAXED);
+    unpinDatabase();
 }
@@ -370,6 +370,165 @@ int VitaMTP_Data_Free_Settings(settings_info_t *settings_info)
     return 0;
 }
 
+/**
+ * Writes the element for one object.
+ *
+ * @param writer where to write.
+ * @param current the object.
+ * @param index the position of the object in the list.
+ * @param buf the buffer writer writes to, only used with index_offset.
+ * @param index_offset if not NULL, set to where the index value starts in buf.
+ * @return zero on success, -1 if the object is not supported.
+ */
+static int VitaMTP_Data_Write_Metadata_Element(xmlTextWriterPtr writer, const metadata_t *current, int index,
+        xmlBufferPtr buf, int *index_offset)
+{
+    char *timestamp;
+
+    if (MASK_SET(current->dataType, SaveData | Folder))
+    {
+        xmlTextWriterStartElement(writer, BAD_CAST "saveData");
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "detail", "%s", current->data.saveData.detail);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dirName", "%s", current->data.saveData.dirName);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "savedataTitle", "%s", current->data.saveData.savedataTitle);
+        timestamp = VitaMTP_Data_Make_Timestamp(current->data.saveData.dateTimeUpdated);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dateTimeUpdated", "%s", timestamp);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->data.saveData.title);
+        free(timestamp);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->data.saveData.statusType);
+    }
+    else if (MASK_SET(current->dataType, Photo | File))
+    {
+        xmlTextWriterStartElement(writer, BAD_CAST "photo");
+        timestamp = VitaMTP_Data_Make_Timestamp(current->data.photo.dateTimeOriginal);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->data.photo.title);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dateTimeOriginal", "%s", timestamp);
+        free(timestamp);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileFormatType", "%d", current->data.photo.fileFormatType);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileName", "%s", current->data.photo.fileName);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->data.photo.statusType);
+    }
+    else if (MASK_SET(current->dataType, Music | File))
+    {
+        xmlTextWriterStartElement(writer, BAD_CAST "music");
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->data.music.title);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "album", "%s", current->data.music.album);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "artist", "%s", current->data.music.artist);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->data.music.statusType);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileFormatType", "%d", current->data.music.fileFormatType);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileName", "%s", current->data.music.fileName);
+    }
+    else if (MASK_SET(current->dataType, Video | File))
+    {
+        xmlTextWriterStartElement(writer, BAD_CAST "video");
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->data.video.title);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileFormatType", "%d", current->data.video.fileFormatType);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileName", "%s", current->data.video.fileName);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "parentalLevel", "%d", current->data.video.parentalLevel);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->data.video.statusType);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "explanation", "%s", current->data.video.explanation);
+        timestamp = VitaMTP_Data_Make_Timestamp(current->data.saveData.dateTimeUpdated);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dateTimeUpdated", "%s", timestamp);
+        free(timestamp);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "copyright", "%s", current->data.video.copyright);
+    }
+    else if (MASK_SET(current->dataType, Thumbnail))
+    {
+        xmlTextWriterStartElement(writer, BAD_CAST "thumbnail");
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "codecType", "%d", current->data.thumbnail.codecType);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "width", "%d", current->data.thumbnail.width);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "height", "%d", current->data.thumbnail.height);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "type", "%d", current->data.thumbnail.type);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "orientationType", "%d", current->data.thumbnail.orientationType);
+        char *aspectRatio;
+        asprintf(&aspectRatio, "%.6f", current->data.thumbnail.aspectRatio);
+        char *period = strchr(aspectRatio, '.');
+        *period = ','; // All this to make period a comma, maybe there is an easier way?
+        xmlTextWriterWriteAttribute(writer, BAD_CAST "aspectRatio", BAD_CAST aspectRatio);
+        free(aspectRatio);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fromType", "%d", current->data.thumbnail.fromType);
+    }
+    else if (current->dataType & Folder)
+    {
+        xmlTextWriterStartElement(writer, BAD_CAST "folder");
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "type", "%d", current->type);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "name", "%s", current->name);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->name);
+    }
+    else if (current->dataType & File)
+    {
+        xmlTextWriterStartElement(writer, BAD_CAST "file");
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "name", "%s", current->name);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->type);
+        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->name);
+    }
+    else
+    {
+        return -1; // not supported
+    }
+
+    if (index_offset != NULL)
+    {
+        // everything up to here is in the buffer once it is flushed
+        xmlTextWriterFlush(writer);
+        *index_offset = (int)xmlBufferLength(buf) + (int)strlen(" index=\"");
+    }
+
+    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "index", "%d", index);
+    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "ohfiParent", "%d", current->ohfiParent);
+    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "ohfi", "%d", current->ohfi);
+    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "size", "%lu", current->size);
+    timestamp = VitaMTP_Data_Make_Timestamp(current->dateTimeCreated);
+    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dateTimeCreated", "%s", timestamp);
+    free(timestamp);
+
+    if (current->dataType & (Photo | Music | Video) && MASK_SET(current->dataType, File))
+    {
+        for (int j = 0; j < current->data.photo.numTracks; j++)   // union layed out so any one of the three can be used
+        {
+            xmlTextWriterStartElement(writer, BAD_CAST "track");
+            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "index", "%d", j+1);
+            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "type", "%d", current->data.video.tracks[j].type);
+
+            switch (current->data.photo.tracks[j].type)
+            {
+            case VITA_TRACK_TYPE_AUDIO:
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "bitrate", "%d",
+                                                  current->data.video.tracks[j].data.track_audio.bitrate);
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "codecType", "%d",
+                                                  current->data.video.tracks[j].data.track_audio.codecType);
+                break;
+
+            case VITA_TRACK_TYPE_VIDEO:
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "width", "%d", current->data.video.tracks[j].data.track_video.width);
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "height", "%d",
+                                                  current->data.video.tracks[j].data.track_video.height);
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "bitrate", "%d",
+                                                  current->data.video.tracks[j].data.track_video.bitrate);
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "codecType", "%d",
+                                                  current->data.video.tracks[j].data.track_video.codecType);
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "duration", "%ld",
+                                                  current->data.video.tracks[j].data.track_video.duration);
+                break;
+
+            case VITA_TRACK_TYPE_PHOTO:
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "width", "%d", current->data.video.tracks[j].data.track_photo.width);
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "height", "%d",
+                                                  current->data.video.tracks[j].data.track_photo.height);
+                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "codecType", "%d",
+                                                  current->data.video.tracks[j].data.track_photo.codecType);
+                break;
+            }
+
+            xmlTextWriterEndElement(writer);
+        }
+    }
+
+    xmlTextWriterEndElement(writer);
+
+    return 0;
+}
+
 /**
  * Takes a metadata linked list and generates XML data.
  * This should be called automatically.
@@ -410,145 +569,13 @@ int VitaMTP_Data_Metadata_To_XML(const metadata_t *p_metadata, char **data, int
     xmlTextWriterStartElement(writer, BAD_CAST "objectMetadata");
 
     int i = 0;
-    int j = 0;
 
     for (const metadata_t *current = p_metadata; current != NULL; current = current->next_metadata)
     {
-        char *timestamp;
-
-        if (MASK_SET(current->dataType, SaveData | Folder))
-        {
-            xmlTextWriterStartElement(writer, BAD_CAST "saveData");
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "detail", "%s", current->data.saveData.detail);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dirName", "%s", current->data.saveData.dirName);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "savedataTitle", "%s", current->data.saveData.savedataTitle);
-            timestamp = VitaMTP_Data_Make_Timestamp(current->data.saveData.dateTimeUpdated);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dateTimeUpdated", "%s", timestamp);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->data.saveData.title);
-            free(timestamp);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->data.saveData.statusType);
-        }
-        else if (MASK_SET(current->dataType, Photo | File))
-        {
-            xmlTextWriterStartElement(writer, BAD_CAST "photo");
-            timestamp = VitaMTP_Data_Make_Timestamp(current->data.photo.dateTimeOriginal);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->data.photo.title);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dateTimeOriginal", "%s", timestamp);
-            free(timestamp);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileFormatType", "%d", current->data.photo.fileFormatType);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileName", "%s", current->data.photo.fileName);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->data.photo.statusType);
-        }
-        else if (MASK_SET(current->dataType, Music | File))
-        {
-            xmlTextWriterStartElement(writer, BAD_CAST "music");
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->data.music.title);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "album", "%s", current->data.music.album);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "artist", "%s", current->data.music.artist);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->data.music.statusType);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileFormatType", "%d", current->data.music.fileFormatType);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileName", "%s", current->data.music.fileName);
-        }
-        else if (MASK_SET(current->dataType, Video | File))
+        if (VitaMTP_Data_Write_Metadata_Element(writer, current, i, NULL, NULL) == 0)
         {
-            xmlTextWriterStartElement(writer, BAD_CAST "video");
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->data.video.title);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileFormatType", "%d", current->data.video.fileFormatType);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fileName", "%s", current->data.video.fileName);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "parentalLevel", "%d", current->data.video.parentalLevel);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->data.video.statusType);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "explanation", "%s", current->data.video.explanation);
-            timestamp = VitaMTP_Data_Make_Timestamp(current->data.saveData.dateTimeUpdated);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dateTimeUpdated", "%s", timestamp);
-            free(timestamp);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "copyright", "%s", current->data.video.copyright);
-        }
-        else if (MASK_SET(current->dataType, Thumbnail))
-        {
-            xmlTextWriterStartElement(writer, BAD_CAST "thumbnail");
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "codecType", "%d", current->data.thumbnail.codecType);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "width", "%d", current->data.thumbnail.width);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "height", "%d", current->data.thumbnail.height);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "type", "%d", current->data.thumbnail.type);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "orientationType", "%d", current->data.thumbnail.orientationType);
-            char *aspectRatio;
-            asprintf(&aspectRatio, "%.6f", current->data.thumbnail.aspectRatio);
-            char *period = strchr(aspectRatio, '.');
-            *period = ','; // All this to make period a comma, maybe there is an easier way?
-            xmlTextWriterWriteAttribute(writer, BAD_CAST "aspectRatio", BAD_CAST aspectRatio);
-            free(aspectRatio);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "fromType", "%d", current->data.thumbnail.fromType);
-        }
-        else if (current->dataType & Folder)
-        {
-            xmlTextWriterStartElement(writer, BAD_CAST "folder");
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "type", "%d", current->type);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "name", "%s", current->name);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->name);
-        }
-        else if (current->dataType & File)
-        {
-            xmlTextWriterStartElement(writer, BAD_CAST "file");
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "name", "%s", current->name);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "statusType", "%d", current->type);
-            xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "title", "%s", current->name);
-        }
-        else
-        {
-            continue; // not supported
-        }
-
-        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "index", "%d", i++);
-        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "ohfiParent", "%d", current->ohfiParent);
-        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "ohfi", "%d", current->ohfi);
-        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "size", "%lu", current->size);
-        timestamp = VitaMTP_Data_Make_Timestamp(current->dateTimeCreated);
-        xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "dateTimeCreated", "%s", timestamp);
-        free(timestamp);
-
-        if (current->dataType & (Photo | Music | Video) && MASK_SET(current->dataType, File))
-        {
-            for (j = 0; j < current->data.photo.numTracks; j++)   // union layed out so any one of the three can be used
-            {
-                xmlTextWriterStartElement(writer, BAD_CAST "track");
-                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "index", "%d", j+1);
-                xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "type", "%d", current->data.video.tracks[j].type);
-
-                switch (current->data.photo.tracks[j].type)
-                {
-                case VITA_TRACK_TYPE_AUDIO:
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "bitrate", "%d",
-                                                      current->data.video.tracks[j].data.track_audio.bitrate);
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "codecType", "%d",
-                                                      current->data.video.tracks[j].data.track_audio.codecType);
-                    break;
-
-                case VITA_TRACK_TYPE_VIDEO:
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "width", "%d", current->data.video.tracks[j].data.track_video.width);
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "height", "%d",
-                                                      current->data.video.tracks[j].data.track_video.height);
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "bitrate", "%d",
-                                                      current->data.video.tracks[j].data.track_video.bitrate);
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "codecType", "%d",
-                                                      current->data.video.tracks[j].data.track_video.codecType);
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "duration", "%ld",
-                                                      current->data.video.tracks[j].data.track_video.duration);
-                    break;
-
-                case VITA_TRACK_TYPE_PHOTO:
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "width", "%d", current->data.video.tracks[j].data.track_photo.width);
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "height", "%d",
-                                                      current->data.video.tracks[j].data.track_photo.height);
-                    xmlTextWriterWriteFormatAttribute(writer, BAD_CAST "codecType", "%d",
-                                                      current->data.video.tracks[j].data.track_photo.codecType);
-                    break;
-                }
-
-                xmlTextWriterEndElement(writer);
-            }
+            i++;
         }
-
-        xmlTextWriterEndElement(writer);
     }
 
     xmlTextWriterEndElement(writer);
@@ -566,6 +593,143 @@ int VitaMTP_Data_Metadata_To_XML(const metadata_t *p_metadata, char **data, int
     return 0;
 }
 
+/**
+ * Generates the XML for a single object so it can be kept and reused.
+ * The index attribute is written as 0 and filled in by
+ * VitaMTP_Data_Metadata_Elements_To_XML() when the list is put together.
+ *
+ * @param p_metadata the object, next_metadata is ignored.
+ * @param element the structure to fill, free element->data when done.
+ * @return zero on success.
+ * @see VitaMTP_SendObjectMetadataElements()
+ */
+int VitaMTP_Data_Metadata_Element_To_XML(const metadata_t *p_metadata, metadata_element_t *element)
+{
+    xmlTextWriterPtr writer;
+    xmlBufferPtr buf;
+    int start;
+    int end;
+
+    buf = xmlBufferCreate();
+
+    if (buf == NULL)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "VitaMTP_Data_Metadata_Element_To_XML: Error creating the xml buffer\n");
+        return 1;
+    }
+
+    writer = xmlNewTextWriterMemory(buf, 0);
+
+    if (writer == NULL)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "VitaMTP_Data_Metadata_Element_To_XML: Error creating the xml writer\n");
+        xmlBufferFree(buf);
+        return 1;
+    }
+
+    // same document settings as a full list, so strings are escaped the same way
+    if (xmlTextWriterStartDocument(writer, NULL, "UTF-8", NULL) < 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "VitaMTP_Data_Metadata_Element_To_XML: Error at xmlTextWriterStartDocument\n");
+        xmlFreeTextWriter(writer);
+        xmlBufferFree(buf);
+        return 1;
+    }
+
+    xmlTextWriterFlush(writer);
+    start = xmlBufferLength(buf);
+
+    if (VitaMTP_Data_Write_Metadata_Element(writer, p_metadata, 0, buf, &element->index_offset) < 0)
+    {
+        xmlFreeTextWriter(writer);
+        xmlBufferFree(buf);
+        return 1;
+    }
+
+    xmlTextWriterFlush(writer);
+    end = xmlBufferLength(buf);
+    xmlFreeTextWriter(writer);
+
+    // keep only the element itself
+    element->len = end - start;
+    element->index_offset -= start;
+    element->data = malloc(element->len);
+    memcpy(element->data, xmlBufferContent(buf) + start, element->len);
+    xmlBufferFree(buf);
+    return 0;
+}
+
+/**
+ * Puts together elements from VitaMTP_Data_Metadata_Element_To_XML()
+ * into the same XML that VitaMTP_Data_Metadata_To_XML() generates.
+ * This should be called automatically.
+ *
+ * @param elements the elements in the order they should be shown.
+ * @param count the number of elements.
+ * @param data a pointer to the array to output.
+ * @param len a pointer to the length of the output.
+ * @return zero on success.
+ * @see VitaMTP_SendObjectMetadataElements()
+ */
+int VitaMTP_Data_Metadata_Elements_To_XML(const metadata_element_t *const *elements, int count, char **data,
+        int *len)
+{
+    static const char header[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<objectMetadata>";
+    static const char footer[] = "</objectMetadata>\n";
+    static const char empty[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<objectMetadata/>\n";
+    char index[16];
+    char *out;
+    uint32_t xml_len;
+    size_t size = sizeof(header) + sizeof(footer);
+    size_t pos;
+    int index_len;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        size += elements[i]->len + sizeof(index);
+    }
+
+    // the size header and the null at the end are part of the data
+    out = malloc(sizeof(uint32_t) + size);
+    pos = sizeof(uint32_t);
+
+    if (count == 0)
+    {
+        memcpy(out + pos, empty, sizeof(empty) - 1);
+        pos += sizeof(empty) - 1;
+    }
+    else
+    {
+        memcpy(out + pos, header, sizeof(header) - 1);
+        pos += sizeof(header) - 1;
+
+        for (i = 0; i < count; i++)
+        {
+            const metadata_element_t *element = elements[i];
+
+            // the element has a one digit placeholder for the index
+            index_len = snprintf(index, sizeof(index), "%d", i);
+            memcpy(out + pos, element->data, element->index_offset);
+            pos += element->index_offset;
+            memcpy(out + pos, index, index_len);
+            pos += index_len;
+            memcpy(out + pos, element->data + element->index_offset + 1, element->len - element->index_offset - 1);
+            pos += element->len - element->index_offset - 1;
+        }
+
+        memcpy(out + pos, footer, sizeof(footer) - 1);
+        pos += sizeof(footer) - 1;
+    }
+
+    out[pos++] = '\0';
+    xml_len = (uint32_t)(pos - sizeof(uint32_t));
+    memcpy(out, &xml_len, sizeof(uint32_t)); // copy header
+    *data = out;
+    *len = (int)pos;
+    return 0;
+}
+
 /**
  * Converts returned XML data into capability_info_t
  * This should be called automatically.
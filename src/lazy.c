@@ -0,0 +1,342 @@
+//
+//  Lazy scanning, folders are read when they are first needed
+//  OpenCMA
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opencma.h"
+
+extern struct cma_paths g_paths;
+
+static pthread_t g_expand_thread;
+static int g_expanding; // only touched by the thread that starts and stops it
+static int g_expand_stop;
+
+static void freeEntries(struct cma_entry *entries, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        free(entries[i].name);
+    }
+
+    free(entries);
+}
+
+// adds what was read in a folder, its subfolders are left for later
+static void addExpansion(struct cma_object *object, struct cma_entry *entries, int count)
+{
+    unsigned long totalSize = 0;
+    int folders = 0;
+    int i;
+
+    // cleared first, adding to an unexpanded folder would read it again
+    object->flags &= ~OBJECT_UNEXPANDED;
+
+    if (count > 0)
+    {
+        addEntriesToDatabase(object, entries, count);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (entries[i].type & Folder)
+        {
+            entries[i].object->flags = OBJECT_UNEXPANDED | OBJECT_INCOMPLETE;
+            watchFolder(entries[i].object);
+            folders++;
+        }
+        else
+        {
+            totalSize += entries[i].object->metadata.size;
+        }
+    }
+
+    if (folders == 0)
+    {
+        object->flags &= ~OBJECT_INCOMPLETE;
+    }
+
+    adjustSize(object, totalSize);
+}
+
+// like nextInTree(), but does not go into folders that are complete
+static struct cma_object *nextIncomplete(struct cma_object *object, const struct cma_object *top)
+{
+    if ((object->flags & OBJECT_INCOMPLETE) && object->first_child != NULL)
+    {
+        return object->first_child;
+    }
+
+    for (; object != top; object = object->parent)
+    {
+        if (object->next_sibling != NULL)
+        {
+            return object->next_sibling;
+        }
+    }
+
+    return NULL;
+}
+
+// the database starts out with only the master objects, folders are read as they are needed
+void createLazyDatabase(struct cma_paths *paths, const char *uuid)
+{
+    createEmptyDatabase(paths, uuid);
+    // the database is basically an array of cma_objects, so we'll cast it so
+    struct cma_object *db_objects = (struct cma_object *)currentDatabase();
+    int i;
+
+    for (i = 0; i < DATABASE_NUM_ROOTS; i++)
+    {
+        db_objects[i].flags = OBJECT_UNEXPANDED | OBJECT_INCOMPLETE;
+    }
+
+    publishDatabase();
+}
+
+// reads the children of a folder if that has not been done yet
+void expandObject(struct cma_object *object)
+{
+    char path[PATH_MAX];
+    struct cma_entry *entries;
+    int count;
+
+    lockCategory(object);
+
+    if (object->flags & OBJECT_UNEXPANDED)
+    {
+        count = readDirectory(objectPath(object, path, sizeof(path)), &entries);
+        addExpansion(object, entries, count);
+        freeEntries(entries, count);
+    }
+
+    unlockCategory(object);
+}
+
+// reads everything still missing under object, so its size is right and its tree can be walked
+void completeObject(struct cma_object *object)
+{
+    struct cma_object **folders = NULL;
+    struct cma_object *current;
+    struct cma_object *next;
+    int count = 0;
+    int capacity = 0;
+    int i;
+
+    lockCategory(object);
+
+    if (!(object->flags & OBJECT_INCOMPLETE))
+    {
+        unlockCategory(object);
+        return;
+    }
+
+    for (current = object; current != NULL; current = nextIncomplete(current, object))
+    {
+        if (current->flags & OBJECT_UNEXPANDED)
+        {
+            if (count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 64;
+                folders = realloc(folders, capacity * sizeof(struct cma_object *));
+            }
+
+            // cleared first, the scan adds to it
+            current->flags &= ~OBJECT_UNEXPANDED;
+            folders[count++] = current;
+        }
+    }
+
+    if (count > 0)
+    {
+        // unexpanded folders have no children, so none of these is under another
+        scanDirectories(folders, count);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        // the scan only adds up sizes as far as the folders it started from
+        if (folders[i]->parent != NULL)
+        {
+            adjustSize(folders[i]->parent, folders[i]->metadata.size);
+        }
+
+        for (current = folders[i]; current != NULL; current = nextInTree(current, folders[i]))
+        {
+            if (current != folders[i] && (current->metadata.dataType & Folder))
+            {
+                watchFolder(current);
+            }
+        }
+    }
+
+    for (current = object; current != NULL; current = next)
+    {
+        next = nextIncomplete(current, object);
+        current->flags = 0;
+    }
+
+    unlockCategory(object);
+    free(folders);
+}
+
+// returns the first unexpanded folder under object, marking what turns out to be complete on the way
+static struct cma_object *findUnexpanded(struct cma_object *object)
+{
+    struct cma_object *child;
+    struct cma_object *found;
+
+    if (!(object->flags & OBJECT_INCOMPLETE))
+    {
+        return NULL;
+    }
+
+    if (object->flags & OBJECT_UNEXPANDED)
+    {
+        return object;
+    }
+
+    for (child = object->first_child; child != NULL; child = child->next_sibling)
+    {
+        if ((found = findUnexpanded(child)) != NULL)
+        {
+            return found;
+        }
+    }
+
+    object->flags &= ~OBJECT_INCOMPLETE;
+    return NULL;
+}
+
+static void *expandThread(void *arg)
+{
+    char path[PATH_MAX];
+    struct cma_object *root;
+    struct cma_object *object = NULL;
+    struct cma_entry *entries;
+    int count;
+    int ohfi;
+    int i = 0;
+
+    lowerPriority();
+
+    // one category after the other, the others are not held up meanwhile
+    while (!__atomic_load_n(&g_expand_stop, __ATOMIC_RELAXED) && i < DATABASE_NUM_ROOTS)
+    {
+        if ((root = lockRoot(i)) == NULL)
+        {
+            break;
+        }
+
+        if ((object = findUnexpanded(root)) == NULL)
+        {
+            unlockCategory(root);
+            i++;
+            continue;
+        }
+
+        ohfi = object->metadata.ohfi;
+        objectPath(object, path, sizeof(path));
+        unlockCategory(root);
+
+        // the Vita can go on browsing while we wait on the disk
+        count = readDirectory(path, &entries);
+
+        // it may have been read or removed in the meantime
+        if ((object = lockObject(ohfi)) != NULL && object->metadata.ohfi == ohfi
+                && (object->flags & OBJECT_UNEXPANDED))
+        {
+            addExpansion(object, entries, count);
+        }
+
+        unlockObject(object);
+        freeEntries(entries, count);
+    }
+
+    if (i == DATABASE_NUM_ROOTS)
+    {
+        LOG(LVERBOSE, "All folders have been read.\n");
+
+        // only now can the snapshot hold everything
+        if (g_paths.cachePath != NULL)
+        {
+            saveDatabase(g_paths.cachePath);
+        }
+    }
+
+    return NULL;
+}
+
+// reads the folders the Vita has not asked for yet, at the lowest priority
+void startExpanding(void)
+{
+    struct cma_object *root;
+    int incomplete = 0;
+    int i;
+
+    if (g_expanding)
+    {
+        return;
+    }
+
+    for (i = 0; i < DATABASE_NUM_ROOTS && (root = lockRoot(i)) != NULL; i++)
+    {
+        incomplete |= root->flags & OBJECT_INCOMPLETE;
+        unlockCategory(root);
+    }
+
+    if (!incomplete)
+    {
+        return;
+    }
+
+    __atomic_store_n(&g_expand_stop, 0, __ATOMIC_RELAXED);
+
+    if (pthread_create(&g_expand_thread, NULL, expandThread, NULL) != 0)
+    {
+        LOG(LERROR, "Cannot create thread for reading folders.\n");
+        return;
+    }
+
+    g_expanding = 1;
+}
+
+// must be called before the database is destroyed
+void stopExpanding(void)
+{
+    if (!g_expanding)
+    {
+        return;
+    }
+
+    __atomic_store_n(&g_expand_stop, 1, __ATOMIC_RELAXED);
+
+    if (pthread_join(g_expand_thread, NULL) != 0)
+    {
+        LOG(LERROR, "Error joining thread for reading folders.\n");
+    }
+
+    g_expanding = 0;
+}
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <utime.h>
 
 #include "opencma.h"
 
@@ -38,6 +39,7 @@ extern struct cma_database *g_database;
 struct cma_paths g_paths;
 char *g_uuid;
 static sem_t *g_refresh_database_request;
+static volatile sig_atomic_t g_stats_request; // set by SIGUSR1, the database thread prints them
 int g_connected = 0;
 unsigned int g_log_level = LINFO;
 
@@ -53,6 +55,9 @@ static const char *g_help_string =
     "       -a path     Path to apps\n"
     "   options\n"
     "       -u path     Path to local URL mappings\n"
+    "       -c file     Cache the database in file for faster startup\n"
+    "       -s          Scan folders only when the Vita needs them\n"
+    "       -S          Print database statistics after every refresh\n"
     "       -l level    logging level, number 1-4.\n"
     "                   1 = error, 2 = info, 3 = verbose, 4 = debug\n"
     "       -h          Show this help text\n"
@@ -67,8 +72,24 @@ static const char *g_help_string =
     "   out of memory. Also beware that using the same path for multiple data\n"
     "   types (photos and videos, for example) is undefined behavior. It can\n"
     "   result in files not showing up without a manual database refresh\n"
-    "   (CTRL+Z). Modifying the directory as OpenCMA is running may also\n"
-    "   result in the same behavior.\n"
+    "   (CTRL+Z). On Linux, changes made to the directories while OpenCMA\n"
+    "   is running are picked up automatically. Elsewhere, they also need a\n"
+    "   manual refresh.\n"
+    "\n"
+    "   With '-c', the database is saved to a file after it is built and is\n"
+    "   loaded from there the next time the Vita connects, as long as the\n"
+    "   top level directories have not changed. Everything is then rescanned\n"
+    "   in the background to pick up changes deeper down. A manual refresh\n"
+    "   (CTRL+Z) always rescans everything. The Vita can keep browsing while\n"
+    "   the new database is built, it is switched over once the scan is done.\n"
+    "\n"
+    "   With '-s', OpenCMA starts without scanning anything. A folder is read\n"
+    "   when the Vita opens it, and the rest are read in the background at a\n"
+    "   low priority. Refreshes after that still scan everything.\n"
+    "\n"
+    "   Sending SIGUSR1 prints how many objects each list has, how much\n"
+    "   memory the database takes and how many lookups it has answered.\n"
+    "   With '-S', the same is printed after every refresh.\n"
     "\n"
     "   URL mappings allow you to redirect Vita's URL download requests to\n"
     "   some file locally. This can be used to, for example, change the file\n"
@@ -136,15 +157,6 @@ static const vita_event_process_t g_event_processes[] =
     vitaEventUnimplementated
 };
 
-static inline void incrementSizeMetadata(struct cma_object *object, size_t size)
-{
-    do
-    {
-        object->metadata.size += size;
-    }
-    while (object->metadata.ohfiParent > 0 && (object = ohfiToObject(object->metadata.ohfiParent)) != NULL);
-}
-
 void vitaEventSendNumOfObject(vita_device_t *device, vita_event_t *event, int eventId)
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendNumOfObject", event->Code, eventId);
@@ -159,7 +171,6 @@ void vitaEventSendNumOfObject(vita_device_t *device, vita_event_t *event, int ev
         return;
     }
 
-    lockDatabase();
     int items = filterObjects(ohfi, NULL);
 
     if (VitaMTP_SendNumOfObject(device, eventId, items) != PTP_RC_OK)
@@ -171,15 +182,13 @@ void vitaEventSendNumOfObject(vita_device_t *device, vita_event_t *event, int ev
         LOG(LVERBOSE, "Returned count of %d objects for OHFI parent %d\n", items, ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
     }
-
-    unlockDatabase();
 }
 
 void vitaEventSendObjectMetadata(vita_device_t *device, vita_event_t *event, int eventId)
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendObjectMetadata", event->Code, eventId);
     browse_info_t browse;
-    metadata_t *meta;
+    struct cma_list list = {0};
 
     if (VitaMTP_GetBrowseInfo(device, eventId, &browse) != PTP_RC_OK)
     {
@@ -187,10 +196,23 @@ void vitaEventSendObjectMetadata(vita_device_t *device, vita_event_t *event, int
         return;
     }
 
-    lockDatabase();
-    filterObjects(browse.ohfiParent, &meta);  // if meta is null, will return empty XML
+    // the list is only good while the category is locked
+    struct cma_object *parent = lockObject(browse.ohfiParent);
+    int count = filterObjects(browse.ohfiParent, &list);  // if nothing is found, will return empty XML
+    const metadata_element_t **elements = malloc((count + 1) * sizeof(metadata_element_t *));
+    const metadata_element_t *element;
+    int i;
+
+    // objects that were listed before are not converted to XML again
+    for (i = 0, count = 0; i < list.count; i++)
+    {
+        if ((element = metadataElement(list.items[i])) != NULL)
+        {
+            elements[count++] = element;
+        }
+    }
 
-    if (VitaMTP_SendObjectMetadata(device, eventId, meta) != PTP_RC_OK)   // send all objects with OHFI parent
+    if (VitaMTP_SendObjectMetadataElements(device, eventId, elements, count) != PTP_RC_OK)   // send all objects with OHFI parent
     {
         LOG(LERROR, "Sending metadata for OHFI parent %d failed\n", browse.ohfiParent);
     }
@@ -200,31 +222,39 @@ void vitaEventSendObjectMetadata(vita_device_t *device, vita_event_t *event, int
         VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
     }
 
-    unlockDatabase();
+    unlockObject(parent);
+    freeList(&list);
+    free(elements);
 }
 
-void vitaEventSendObject(vita_device_t *device, vita_event_t *event, int eventId)
+// filters and groups look up as their master object, so anything that writes or removes asks for the object itself
+// returns NULL with nothing locked for those
+static struct cma_object *lockOwnObject(int ohfi)
 {
-    LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendObject", event->Code, eventId);
-    uint32_t ohfi = event->Param2;
-    uint32_t parentHandle = event->Param3;
-    uint32_t handle;
-    lockDatabase();
-    struct cma_object *object = ohfiToObject(ohfi);
-    struct cma_object *start = object;
-    struct cma_object *temp = NULL;
+    struct cma_object *object = lockObject(ohfi);
 
-    if (object == NULL)
+    if (object != NULL && object->metadata.ohfi != ohfi)
     {
-        unlockDatabase();
-        LOG(LERROR, "Failed to find OHFI %d.\n", ohfi);
-        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
-        return;
+        LOG(LERROR, "OHFI %d is a filter or group, not a file or folder.\n", ohfi);
+        unlockObject(object);
+        return NULL;
     }
 
+    return object;
+}
+
+// sends the object and everything under it, the category must be locked
+// returns -1 once something could not be sent, the Vita has been told then
+static int sendTree(vita_device_t *device, int eventId, struct cma_object *start, uint32_t parentHandle,
+                    uint32_t *p_handle)
+{
+    struct cma_object *object = start;
+    char path[PATH_MAX];
     unsigned char *data = NULL;
     unsigned int len = 0;
 
+    completeObject(object); // everything under it is sent
+
     do
     {
         data = NULL;
@@ -234,50 +264,108 @@ void vitaEventSendObject(vita_device_t *device, vita_event_t *event, int eventId
         // if it is a directory, data and len are not used by VitaMTP
         if (object->metadata.dataType & File)
         {
-            if (readFileToBuffer(object->path, 0, &data, &len) < 0)
+            if (readFileToBuffer(objectPath(object, path, sizeof(path)), 0, &data, &len) < 0)
             {
-                unlockDatabase();
-                LOG(LERROR, "Failed to read %s.\n", object->path);
+                LOG(LERROR, "Failed to read %s.\n", path);
                 VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Not_Exist_Object);
-                return;
+                return -1;
             }
         }
 
         // get the PTP object ID for the parent to put the object
-        // we know the parent has to be before the current node
+        // the parent is always sent before its children
         // the first time this is called, parentHandle is left untouched
-        for (temp = start; temp != NULL && temp != object; temp = temp->next_object)
+        if (object != start)
         {
-            if (temp->metadata.ohfi == object->metadata.ohfiParent)
-            {
-                parentHandle = temp->metadata.handle;
-                break;
-            }
+            parentHandle = object->parent->metadata.handle;
         }
 
         // send the data over
         // TODO: Use mmap when sending extra large objects like videos
         LOG(LINFO, "Sending %s of %u bytes to device.\n", object->metadata.name, len);
-        LOG(LDEBUG, "OHFI %d with handle 0x%08X\n", ohfi, parentHandle);
+        LOG(LDEBUG, "OHFI %d with handle 0x%08X\n", object->metadata.ohfi, parentHandle);
 
-        if (VitaMTP_SendObject(device, &parentHandle, &handle, &object->metadata, data) != PTP_RC_OK)
+        if (VitaMTP_SendObject(device, &parentHandle, p_handle, &object->metadata, data) != PTP_RC_OK)
         {
             LOG(LERROR, "Sending of %s failed.\n", object->metadata.name);
-            unlockDatabase();
             free(data);
-            return;
+            return -1;
         }
 
-        object->metadata.handle = handle;
-        object = object->next_object;
+        object->metadata.handle = *p_handle;
+        object = nextInTree(object, start);
 
         free(data);
     }
-    while (object != NULL && object->metadata.ohfiParent >= OHFI_OFFSET);  // get everything under this "folder"
+    while (object != NULL);  // get everything under this "folder"
 
-    unlockDatabase();
-    VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_OK, handle);
-    VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Data);  // TODO: Send thumbnail
+    return 0;
+}
+
+// a filter or group has no files of its own, what it lists is sent instead, the category must be locked
+static int sendMembers(vita_device_t *device, int eventId, int ohfi, uint32_t parentHandle, uint32_t *p_handle)
+{
+    struct cma_list list = {0};
+    struct cma_object *object;
+    int ret = 0;
+    int i;
+
+    filterObjects(ohfi, &list);
+
+    for (i = 0; i < list.count && ret == 0; i++)
+    {
+        if ((object = ohfiToObject(list.items[i]->ohfi)) == NULL)
+        {
+            continue;
+        }
+        else if (object->metadata.ohfi != list.items[i]->ohfi)
+        {
+            // an artist lists its albums
+            ret = sendMembers(device, eventId, list.items[i]->ohfi, parentHandle, p_handle);
+        }
+        else
+        {
+            ret = sendTree(device, eventId, object, parentHandle, p_handle);
+        }
+    }
+
+    freeList(&list);
+    return ret;
+}
+
+void vitaEventSendObject(vita_device_t *device, vita_event_t *event, int eventId)
+{
+    LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendObject", event->Code, eventId);
+    uint32_t ohfi = event->Param2;
+    uint32_t parentHandle = event->Param3;
+    uint32_t handle = 0;
+    struct cma_object *object = lockObject(ohfi);
+    int ret;
+
+    if (object == NULL)
+    {
+        LOG(LERROR, "Failed to find OHFI %d.\n", ohfi);
+        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
+        return;
+    }
+
+    // filters and groups look up as the master object, that is not what the Vita asked for
+    if (object->metadata.ohfi != (int)ohfi)
+    {
+        ret = sendMembers(device, eventId, ohfi, parentHandle, &handle);
+    }
+    else
+    {
+        ret = sendTree(device, eventId, object, parentHandle, &handle);
+    }
+
+    unlockObject(object);
+
+    if (ret == 0)
+    {
+        VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_OK, handle);
+        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Data);  // TODO: Send thumbnail
+    }
 }
 
 void vitaEventCancelTask(vita_device_t *device, vita_event_t *event, int eventId)
@@ -345,7 +433,7 @@ void vitaEventSendObjectStatus(vita_device_t *device, vita_event_t *event, int e
         return;
     }
 
-    lockDatabase();
+    struct cma_object *root = lockObject(objectstatus.ohfiRoot);
     object = pathToObject(objectstatus.title, objectstatus.ohfiRoot);
 
     if (object == NULL)  // not in database, don't return metadata
@@ -355,11 +443,13 @@ void vitaEventSendObjectStatus(vita_device_t *device, vita_event_t *event, int e
     }
     else
     {
-        metadata_t *metadata = &object->metadata;
-        metadata->next_metadata = NULL;
+        completeObject(object); // for the size
+        // a copy, so the list it is sent as does not touch the object
+        metadata_t metadata = object->metadata;
+        metadata.next_metadata = NULL;
         LOG(LDEBUG, "Sending metadata for OHFI %d.\n", object->metadata.ohfi);
 
-        if (VitaMTP_SendObjectMetadata(device, eventId, metadata) != PTP_RC_OK)
+        if (VitaMTP_SendObjectMetadata(device, eventId, &metadata) != PTP_RC_OK)
         {
             LOG(LERROR, "Error sending metadata for %d\n", object->metadata.ohfi);
         }
@@ -369,7 +459,7 @@ void vitaEventSendObjectStatus(vita_device_t *device, vita_event_t *event, int e
         }
     }
 
-    unlockDatabase();
+    unlockObject(root);
     free(objectstatus.title);
 }
 
@@ -378,12 +468,10 @@ void vitaEventSendObjectThumb(vita_device_t *device, vita_event_t *event, int ev
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendObjectThumb", event->Code, eventId);
     char thumbpath[PATH_MAX];
     uint32_t ohfi = event->Param2;
-    lockDatabase();
-    struct cma_object *object = ohfiToObject(ohfi);
+    struct cma_object *object = lockObject(ohfi);
 
     if (object == NULL)
     {
-        unlockDatabase();
         LOG(LERROR, "Cannot find OHFI %d in database.\n", ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
         return;
@@ -394,23 +482,24 @@ void vitaEventSendObjectThumb(vita_device_t *device, vita_event_t *event, int ev
     if (MASK_SET(object->metadata.dataType, Photo))
     {
         // TODO: Don't send full image (may be too large)
-        LOG(LDEBUG, "Sending photo as thumbnail %s", object->metadata.path);
-        strcpy(thumbpath, object->path);
+        objectPath(object, thumbpath, sizeof(thumbpath));
+        LOG(LDEBUG, "Sending photo as thumbnail %s", thumbpath);
     }
     else if (MASK_SET(object->metadata.dataType, SaveData))
     {
+        objectPath(object, thumbpath, sizeof(thumbpath) - strlen("/ICON0.PNG"));
+        strcat(thumbpath, "/ICON0.PNG");
         LOG(LDEBUG, "Sending savedata thumbnail %s\n", thumbpath);
-        sprintf(thumbpath, "%s/%s", object->path, "ICON0.PNG");
     }
     else
     {
-        LOG(LERROR, "Thumbnail sending for the file %s is not supported.\n", object->metadata.path);
-        unlockDatabase();
+        LOG(LERROR, "Thumbnail sending for the file %s is not supported.\n", object->metadata.name);
+        unlockObject(object);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Data);
         return;
     }
 
-    unlockDatabase();
+    unlockObject(object);
     // TODO: Get thumbnail data correctly
     unsigned char *data;
     unsigned int len = 0;
@@ -438,26 +527,34 @@ void vitaEventDeleteObject(vita_device_t *device, vita_event_t *event, int event
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestDeleteObject", event->Code, eventId);
     int ohfi = event->Param2;
-    lockDatabase();
-    struct cma_object *object = ohfiToObject(ohfi);
+    char path[PATH_MAX];
+    struct cma_object *object = lockOwnObject(ohfi);
 
     if (object == NULL)
     {
-        unlockDatabase();
         LOG(LERROR, "OHFI %d not found.\n", ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
         return;
     }
 
-    struct cma_object *parent = ohfiToObject(object->metadata.ohfiParent);
+    // removeFromDatabase() refuses those too, but only after the files are gone
+    if (object->parent == NULL)
+    {
+        LOG(LERROR, "Refusing to delete master object %d.\n", ohfi);
+        unlockObject(object);
+        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Permission);
+        return;
+    }
 
-    deleteAll(object->path);
+    deleteAll(objectPath(object, path, sizeof(path)));
 
-    LOG(LINFO, "Deleted %s\n", object->metadata.path);
+    LOG(LINFO, "Deleted %s\n", path);
 
-    removeFromDatabase(ohfi, parent);
+    // the object is freed with it, the parent is in the same category
+    struct cma_object *parent = object->parent;
+    removeFromDatabase(ohfi);
 
-    unlockDatabase();
+    unlockObject(parent);
 
     VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
 }
@@ -531,12 +628,10 @@ void vitaEventSendPartOfObject(vita_device_t *device, vita_event_t *event, int e
         return;
     }
 
-    lockDatabase();
-    struct cma_object *object = ohfiToObject(part_init.ohfi);
+    struct cma_object *object = lockOwnObject(part_init.ohfi);
 
     if (object == NULL)
     {
-        unlockDatabase();
         LOG(LERROR, "Cannot find object for OHFI %d\n", part_init.ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Context);
         return;
@@ -544,17 +639,18 @@ void vitaEventSendPartOfObject(vita_device_t *device, vita_event_t *event, int e
 
     unsigned char *data;
     unsigned int len = (unsigned int)part_init.size;
+    char path[PATH_MAX];
 
-    if (readFileToBuffer(object->path, part_init.offset, &data, &len) < 0)
+    if (readFileToBuffer(objectPath(object, path, sizeof(path)), part_init.offset, &data, &len) < 0)
     {
-        LOG(LERROR, "Cannot read %s.\n", object->path);
+        LOG(LERROR, "Cannot read %s.\n", path);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Not_Exist_Object);
-        unlockDatabase();
+        unlockObject(object);
         return;
     }
 
-    LOG(LINFO, "Sending %s at file offset %llu for %llu bytes\n", object->metadata.path, part_init.offset, part_init.size);
-    unlockDatabase();
+    LOG(LINFO, "Sending %s at file offset %llu for %llu bytes\n", path, part_init.offset, part_init.size);
+    unlockObject(object);
 
     if (VitaMTP_SendPartOfObject(device, eventId, data, len) != PTP_RC_OK)
     {
@@ -579,17 +675,16 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
         return;
     }
 
-    lockDatabase();
-    struct cma_object *root = ohfiToObject(operateobject.ohfi);
+    struct cma_object *root = lockOwnObject(operateobject.ohfi);
     struct cma_object *newobj;
+    char path[PATH_MAX];
     // for renaming only
-    char *origFullPath;
+    char origFullPath[PATH_MAX];
     char *origName;
 
     // end for renaming only
     if (root == NULL)
     {
-        unlockDatabase();
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Not_Exist_Object);
         return;
     }
@@ -599,65 +694,61 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
     {
     case VITA_OPERATE_CREATE_FOLDER:
         LOG(LDEBUG, "Operate command %d: Create folder %s\n", operateobject.cmd, operateobject.title);
-        newobj = addToDatabase(root, operateobject.title, 0, Folder);
+        newobj = addToDatabase(root, operateobject.title, 0, Folder, time(NULL));
 
-        if (createNewDirectory(newobj->path) < 0)
+        if (createNewDirectory(objectPath(newobj, path, sizeof(path))) < 0)
         {
-            removeFromDatabase(newobj->metadata.ohfi, root);
+            removeFromDatabase(newobj->metadata.ohfi);
             LOG(LERROR, "Unable to create temporary folder: %s\n", operateobject.title);
             VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Failed_Operate_Object);
             break;
         }
 
-        LOG(LINFO, "Created folder %s\n", newobj->metadata.path);
-        LOG(LVERBOSE, "Folder %s with OHFI %d under parent %s\n", newobj->path, newobj->metadata.ohfi, root->metadata.path);
+        LOG(LINFO, "Created folder %s\n", path);
+        LOG(LVERBOSE, "Folder %s with OHFI %d under parent OHFI %d\n", newobj->metadata.name, newobj->metadata.ohfi,
+            root->metadata.ohfi);
         VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_OK, newobj->metadata.ohfi);
         break;
 
     case VITA_OPERATE_CREATE_FILE:
         LOG(LDEBUG, "Operate command %d: Create file %s\n", operateobject.cmd, operateobject.title);
-        newobj = addToDatabase(root, operateobject.title, 0, File);
+        newobj = addToDatabase(root, operateobject.title, 0, File, time(NULL));
 
-        if (createNewFile(newobj->path) < 0)
+        if (createNewFile(objectPath(newobj, path, sizeof(path))) < 0)
         {
-            removeFromDatabase(newobj->metadata.ohfi, root);
+            removeFromDatabase(newobj->metadata.ohfi);
             LOG(LERROR, "Unable to create temporary file: %s\n", operateobject.title);
             VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Failed_Operate_Object);
             break;
         }
 
-        LOG(LINFO, "Created file %s\n", newobj->metadata.path);
-        LOG(LVERBOSE, "File %s with OHFI %d under parent %s\n", newobj->path, newobj->metadata.ohfi, root->metadata.path);
+        LOG(LINFO, "Created file %s\n", path);
+        LOG(LVERBOSE, "File %s with OHFI %d under parent OHFI %d\n", newobj->metadata.name, newobj->metadata.ohfi,
+            root->metadata.ohfi);
         VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_OK, newobj->metadata.ohfi);
         break;
 
     case VITA_OPERATE_RENAME:
         LOG(LDEBUG, "Operate command %d: Rename %s to %s\n", operateobject.cmd, root->metadata.name, operateobject.title);
-        origName = strdup(root->metadata.name);
-        origFullPath = strdup(root->path);
+        origName = root->metadata.name; // names are kept until the database is destroyed
+        objectPath(root, origFullPath, sizeof(origFullPath));
         // rename in database
-        renameRootEntry(root, NULL, operateobject.title);
+        renameRootEntry(root, operateobject.title);
 
         // rename in filesystem
-        if (rename(origFullPath, root->path) < 0)
+        if (rename(origFullPath, objectPath(root, path, sizeof(path))) < 0)
         {
             // report the failure
             LOG(LERROR, "Unable to rename %s to %s\n", origName, operateobject.title);
             // rename back
-            renameRootEntry(root, NULL, origName);
-            // free old data
-            free(origFullPath);
-            free(origName);
+            renameRootEntry(root, origName);
             // send result
             VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Failed_Operate_Object);
             break;
         }
 
-        LOG(LINFO, "Renamed %s to %s\n", origName, root->metadata.path);
+        LOG(LINFO, "Renamed %s to %s\n", origName, path);
         LOG(LVERBOSE, "Renamed OHFI %d from %s to %s\n", root->metadata.ohfi, origName, root->metadata.name);
-        // free old data
-        free(origFullPath);
-        free(origName);
         // send result
         VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_OK, root->metadata.ohfi);
         break;
@@ -669,7 +760,7 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
 
     }
 
-    unlockDatabase();
+    unlockObject(root);
     free(operateobject.title);
 }
 
@@ -678,6 +769,7 @@ void vitaEventGetPartOfObject(vita_device_t *device, vita_event_t *event, int ev
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestGetPartOfObject", event->Code, eventId);
     unsigned char *data;
     send_part_init_t part_init;
+    char path[PATH_MAX];
 
     if (VitaMTP_GetPartOfObject(device, eventId, &part_init, &data) != PTP_RC_OK)
     {
@@ -685,34 +777,33 @@ void vitaEventGetPartOfObject(vita_device_t *device, vita_event_t *event, int ev
         return;
     }
 
-    lockDatabase();
-    struct cma_object *object = ohfiToObject(part_init.ohfi);
+    struct cma_object *object = lockOwnObject(part_init.ohfi);
 
     if (object == NULL)
     {
-        unlockDatabase();
         LOG(LERROR, "Cannot find OHFI %d.\n", part_init.ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
         free(data);
         return;
     }
 
-    LOG(LINFO, "Receiving %s at offset %llu for %llu bytes\n", object->metadata.path, part_init.offset, part_init.size);
+    objectPath(object, path, sizeof(path));
+    LOG(LINFO, "Receiving %s at offset %llu for %llu bytes\n", path, part_init.offset, part_init.size);
 
-    if (writeFileFromBuffer(object->path, part_init.offset, data, part_init.size) < 0)
+    if (writeFileFromBuffer(path, part_init.offset, data, part_init.size) < 0)
     {
-        LOG(LERROR, "Cannot write to file %s.\n", object->path);
+        LOG(LERROR, "Cannot write to file %s.\n", path);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Permission);
     }
     else
     {
-        // add size to all parents
-        incrementSizeMetadata(object, part_init.size);
-        LOG(LDEBUG, "Written %llu bytes to %s at offset %llu.\n", part_init.size, object->path, part_init.offset);
+        // the folders above only get the size once the whole file is in
+        growObject(object, part_init.offset + part_init.size);
+        LOG(LDEBUG, "Written %llu bytes to %s at offset %llu.\n", part_init.size, path, part_init.offset);
         VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
     }
 
-    unlockDatabase();
+    unlockObject(object);
     free(data);
 }
 
@@ -720,41 +811,42 @@ void vitaEventSendStorageSize(vita_device_t *device, vita_event_t *event, int ev
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendStorageSize", event->Code, eventId);
     int ohfi = event->Param2;
-    lockDatabase();
-    struct cma_object *object = ohfiToObject(ohfi);
+    struct cma_object *object = lockObject(ohfi);
     uint64_t total;
     uint64_t free;
+    char path[PATH_MAX];
 
     if (object == NULL)
     {
-        unlockDatabase();
         LOG(LERROR, "Cannot find OHFI %d.\n", ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
         return;
     }
 
-    if (!fileExists(object->path))
+    objectPath(object, path, sizeof(path));
+
+    if (!fileExists(path))
     {
-        LOG(LINFO, "Creating %s\n", object->path);
+        LOG(LINFO, "Creating %s\n", path);
 
-        if (createNewDirectory(object->path) < 0)
+        if (createNewDirectory(path) < 0)
         {
-            unlockDatabase();
+            unlockObject(object);
             LOG(LERROR, "Create directory failed.\n");
             VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Permission);
             return;
         }
     }
 
-    if (getDiskSpace(object->path, &free, &total) < 0)
+    if (getDiskSpace(path, &free, &total) < 0)
     {
-        unlockDatabase();
+        unlockObject(object);
         LOG(LERROR, "Cannot get disk space.\n");
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Permission);
         return;
     }
 
-    unlockDatabase();
+    unlockObject(object);
     LOG(LVERBOSE, "For drive containing OHFI %d, free: %llu, total: %llu\n", ohfi, free, total);
 
     if (VitaMTP_SendStorageSize(device, eventId, total, free) != PTP_RC_OK)   // Send fake 50GB/100GB
@@ -773,6 +865,7 @@ void vitaEventCheckExistance(vita_device_t *device, vita_event_t *event, int eve
     int handle = event->Param2;
     existance_object_t existance;
     struct cma_object *object;
+    int ohfi;
 
     if (VitaMTP_CheckExistance(device, handle, &existance) != PTP_RC_OK)
     {
@@ -780,22 +873,33 @@ void vitaEventCheckExistance(vita_device_t *device, vita_event_t *event, int eve
         return;
     }
 
+    // the name can be in any category
     lockDatabase();
+    ohfi = (object = pathToObject(existance.name, 0)) != NULL ? object->metadata.ohfi : 0;
+    unlockDatabase();
+
+    // saves of one game can start the same, so the content only counts for a file that was renamed
+    // the files are read with nothing locked
+    if (ohfi == 0)
+    {
+        ohfi = findByContent(existance.size, existance.data, existance.data_length);
+    }
 
-    if ((object = pathToObject(existance.name, 0)) == NULL)
+    if (ohfi == 0)
     {
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Different_Object);
     }
     else
     {
-        VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_VITA_Same_Object, object->metadata.ohfi);
+        VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_VITA_Same_Object, ohfi);
     }
 
-    unlockDatabase();
     VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
 }
 
-uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, struct cma_object *parent, uint32_t handle)
+// receives the objects into the folder with OHFI ohfiParent, and whatever is in the folders among them
+// the transfer can take a while, so the category is only locked to look things up and to add the batch
+uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, int ohfiParent, uint32_t *handles, unsigned int count)
 {
     union
     {
@@ -804,96 +908,179 @@ uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, struct cma_object
     } data;
     unsigned int length;
     metadata_t tempMeta;
-    struct cma_object *object;
+    struct cma_object *parent;
     struct cma_object *temp;
+    struct cma_entry *entries = calloc(count, sizeof(struct cma_entry));
+    struct
+    {
+        unsigned int handle;
+        uint32_t *children;
+        unsigned int numChildren;
+        int ohfi;
+    } *received = calloc(count, sizeof(*received));
+    unsigned long totalSize = 0;
+    unsigned int numReceived;
     unsigned int i;
-    uint16_t ret;
+    char folder[PATH_MAX];
+    char path[PATH_MAX];
+    int existed;
+    uint16_t ret = PTP_RC_OK;
 
-    if (VitaMTP_GetObject(device, handle, &tempMeta, (void **)&data, &length) != PTP_RC_OK)
+    if ((parent = lockOwnObject(ohfiParent)) == NULL)
     {
-        LOG(LERROR, "Cannot get object for handle %d.\n", handle);
-        return PTP_RC_VITA_Invalid_Data;
+        LOG(LERROR, "Cannot find parent OHFI %d.\n", ohfiParent);
+        free(entries);
+        free(received);
+        return PTP_RC_VITA_Invalid_OHFI;
     }
 
-    lockDatabase();
+    objectPath(parent, folder, sizeof(folder));
+    unlockObject(parent);
 
-    if ((object = addToDatabase(parent, tempMeta.name, 0, tempMeta.dataType)) == NULL)    // size will be added after read
+    // get everything in this folder first so it can be added in one batch
+    for (numReceived = 0; numReceived < count; numReceived++)
     {
-        unlockDatabase();
-        LOG(LERROR, "Cannot add object %s to database.\n", tempMeta.name);
-        free(tempMeta.name);
-        free(data.fileData);
-        return PTP_RC_VITA_Invalid_Data;
-    }
+        if (VitaMTP_GetObject(device, handles[numReceived], &tempMeta, (void **)&data, &length) != PTP_RC_OK)
+        {
+            LOG(LERROR, "Cannot get object for handle %d.\n", handles[numReceived]);
+            ret = PTP_RC_VITA_Invalid_Data;
+            break;
+        }
 
-    object->metadata.handle = tempMeta.handle;
-    free(tempMeta.name);  // not needed anymore, copy in object
+        snprintf(path, sizeof(path), "%s/%s", folder, tempMeta.name);
 
-    if ((temp = pathToObject(object->metadata.name, parent->metadata.ohfi)) != object
-            && temp != NULL)    // check if object exists already
-    {
-        // delete existing file/folder
-        LOG(LDEBUG, "Deleting %s\n", temp->path);
-        deleteAll(temp->path);
-        removeFromDatabase(temp->metadata.ohfi, parent);
-    }
+        // check if object exists already
+        existed = 0;
 
-    if (object->metadata.dataType & File)
-    {
-        LOG(LINFO, "Receiving %s for %lu bytes.\n", object->metadata.path, tempMeta.size);
+        if ((parent = lockObject(ohfiParent)) != NULL && (temp = pathToObject(tempMeta.name, ohfiParent)) != NULL)
+        {
+            removeFromDatabase(temp->metadata.ohfi);
+            existed = 1;
+        }
+
+        unlockObject(parent);
 
-        if (writeFileFromBuffer(object->path, 0, data.fileData, tempMeta.size) < 0)
+        if (existed)
         {
-            LOG(LERROR, "Cannot write to %s.\n", object->path);
-            removeFromDatabase(object->metadata.ohfi, parent);
-            unlockDatabase();
+            // delete existing file/folder
+            LOG(LDEBUG, "Deleting %s\n", path);
+            deleteAll(path);
+        }
+
+        if (tempMeta.dataType & File)
+        {
+            LOG(LINFO, "Receiving %s for %lu bytes.\n", path, tempMeta.size);
+
+            if (writeFileFromBuffer(path, 0, data.fileData, tempMeta.size) < 0)
+            {
+                LOG(LERROR, "Cannot write to %s.\n", path);
+                ret = PTP_RC_VITA_Invalid_Permission;
+            }
+            else
+            {
+                totalSize += tempMeta.size;
+
+                // keep the time it has on the Vita, so a rescan lists it under the same month
+                if (tempMeta.dateTimeCreated != 0)
+                {
+                    struct utimbuf times = {(time_t)tempMeta.dateTimeCreated, (time_t)tempMeta.dateTimeCreated};
+                    utime(path, &times);
+                }
+            }
+
             free(data.fileData);
-            return PTP_RC_VITA_Invalid_Permission;
+        }
+        else if (tempMeta.dataType & Folder)
+        {
+            LOG(LINFO, "Receiving directory %s\n", path);
+
+            if (createNewDirectory(path) < 0)
+            {
+                LOG(LERROR, "Cannot create directory: %s\n", path);
+                ret = PTP_RC_VITA_Failed_Operate_Object;
+                free(data.handles);
+            }
+            else
+            {
+                // the contents are received once the folder is in the database
+                received[numReceived].children = data.handles;
+                received[numReceived].numChildren = length;
+            }
+        }
+        else
+        {
+            assert(0);  // should not be here
+        }
+
+        if (ret != PTP_RC_OK)
+        {
+            free(tempMeta.name);
+            break;
         }
 
-        incrementSizeMetadata(object, tempMeta.size);
+        entries[numReceived].name = tempMeta.name;
+        entries[numReceived].size = (tempMeta.dataType & File) ? tempMeta.size : 0;
+        entries[numReceived].type = tempMeta.dataType;
+        entries[numReceived].time = tempMeta.dateTimeCreated != 0 ? (time_t)tempMeta.dateTimeCreated : time(NULL);
+        received[numReceived].handle = tempMeta.handle;
     }
-    else if (object->metadata.dataType & Folder)
+
+    if ((parent = lockOwnObject(ohfiParent)) == NULL)
+    {
+        // the folder went away meanwhile, so did what was put in it
+        ret = PTP_RC_VITA_Invalid_OHFI;
+    }
+    else
     {
-        LOG(LINFO, "Receiving directory %s\n", object->metadata.path);
+        // the watcher may have seen the new files before the batch is in
+        for (i = 0; i < numReceived; i++)
+        {
+            if ((temp = pathToObject(entries[i].name, ohfiParent)) != NULL)
+            {
+                removeFromDatabase(temp->metadata.ohfi);
+            }
+        }
+
+        addEntriesToDatabase(parent, entries, numReceived);
 
-        if (createNewDirectory(object->path) < 0)
+        for (i = 0; i < numReceived; i++)
         {
-            removeFromDatabase(object->metadata.ohfi, parent);
-            LOG(LERROR, "Cannot create directory: %s\n", object->path);
-            unlockDatabase();
-            free(data.fileData);
-            return PTP_RC_VITA_Failed_Operate_Object;
+            entries[i].object->metadata.handle = received[i].handle;
+            received[i].ohfi = entries[i].object->metadata.ohfi;
         }
 
-        for (i = 0; i < length; i++)
+        // add size to all parents
+        adjustSize(parent, totalSize);
+        countChange();
+        unlockObject(parent);
+    }
+
+    for (i = 0; i < numReceived; i++)
+    {
+        if (ret == PTP_RC_OK && (entries[i].type & Folder))
         {
-            ret = vitaGetAllObjects(device, eventId, object, data.handles[i]);
+            ret = vitaGetAllObjects(device, eventId, received[i].ohfi, received[i].children, received[i].numChildren);
 
             if (ret != PTP_RC_OK)
             {
-                removeFromDatabase(object->metadata.ohfi, parent);
-                unlockDatabase();
-                free(data.fileData);
-                return ret;
+                removeFromDatabase(received[i].ohfi);
             }
         }
-    }
-    else
-    {
-        assert(0);  // should not be here
+
+        free(entries[i].name);
+        free(received[i].children);
     }
 
-    unlockDatabase();
-    free(data.fileData);
-    return PTP_RC_OK;
+    free(entries);
+    free(received);
+    return ret;
 }
 
 void vitaEventGetTreatObject(vita_device_t *device, vita_event_t *event, int eventId)
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestGetTreatObject", event->Code, eventId);
     treat_object_t treatObject;
-    struct cma_object *parent;
+    uint32_t handle;
 
     if (VitaMTP_GetTreatObject(device, eventId, &treatObject) != PTP_RC_OK)
     {
@@ -901,14 +1088,8 @@ void vitaEventGetTreatObject(vita_device_t *device, vita_event_t *event, int eve
         return;
     }
 
-    if ((parent = ohfiToObject(treatObject.ohfiParent)) == NULL)
-    {
-        LOG(LERROR, "Cannot find parent OHFI %d.\n", treatObject.ohfiParent);
-        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
-        return;
-    }
-
-    VitaMTP_ReportResult(device, eventId, vitaGetAllObjects(device, eventId, parent, treatObject.handle));
+    handle = treatObject.handle;
+    VitaMTP_ReportResult(device, eventId, vitaGetAllObjects(device, eventId, treatObject.ohfiParent, &handle, 1));
 }
 
 void vitaEventSendCopyConfirmationInfo(vita_device_t *device, vita_event_t *event, int eventId)
@@ -923,25 +1104,24 @@ void vitaEventSendCopyConfirmationInfo(vita_device_t *device, vita_event_t *even
         return;
     }
 
-    lockDatabase();
     uint32_t i;
     uint64_t size = 0;
 
+    // the objects can be in different categories, so each is locked on its own
     for (i = 0; i < info->count; i++)
     {
-        if ((object = ohfiToObject(info->ohfi[i])) == NULL)
+        if ((object = lockObject(info->ohfi[i])) == NULL)
         {
             LOG(LERROR, "Cannot find OHFI %d.\n", info->ohfi[i]);
             free(info);
-            unlockDatabase();
             return;
         }
 
+        completeObject(object);
         size += object->metadata.size;
+        unlockObject(object);
     }
 
-    unlockDatabase();
-
     if (VitaMTP_SendCopyConfirmationInfo(device, eventId, info, size) != PTP_RC_OK)
     {
         LOG(LERROR, "Error sending copy confirmation.\n");
@@ -965,22 +1145,22 @@ void vitaEventSendObjectMetadataItems(vita_device_t *device, vita_event_t *event
         return;
     }
 
-    lockDatabase();
-    struct cma_object *object = ohfiToObject(ohfi);
+    struct cma_object *object = lockObject(ohfi);
 
     if (object == NULL)
     {
-        unlockDatabase();
         LOG(LERROR, "Cannot find OHFI %d in database\n", ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
         return;
     }
 
-    metadata_t *metadata = &object->metadata;
-    metadata->next_metadata = NULL;
-    LOG(LVERBOSE, "Sending metadata for OHFI %d (%s)\n", ohfi, metadata->path);
+    completeObject(object); // for the size
+    // a copy, so the list it is sent as does not touch the object
+    metadata_t metadata = object->metadata;
+    metadata.next_metadata = NULL;
+    LOG(LVERBOSE, "Sending metadata for OHFI %d (%s)\n", ohfi, metadata.name);
 
-    if (VitaMTP_SendObjectMetadata(device, eventId, metadata) != PTP_RC_OK)
+    if (VitaMTP_SendObjectMetadata(device, eventId, &metadata) != PTP_RC_OK)
     {
         LOG(LERROR, "Error sending metadata.\n");
     }
@@ -989,7 +1169,7 @@ void vitaEventSendObjectMetadataItems(vita_device_t *device, vita_event_t *event
         VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
     }
 
-    unlockDatabase();
+    unlockObject(object);
 }
 
 void vitaEventSendNPAccountInfo(vita_device_t *device, vita_event_t *event, int eventId)
@@ -1033,6 +1213,13 @@ void *vitaEventListener(vita_device_t *device)
         }
 
         LOG(LDEBUG, "Event 0x%04X recieved, slot %d with function address %p\n", event.Code, slot, g_event_processes[slot]);
+
+        // files are sent in parts back to back, anything else means the last one is done
+        if (g_event_processes[slot] != vitaEventGetPartOfObject)
+        {
+            settleSizes();
+        }
+
         g_event_processes[slot](device, &event, event.Param1);
     }
 
@@ -1118,6 +1305,12 @@ static vita_device_t *connect_wireless()
     return device;
 }
 
+// the main thread will rebuild the database as soon as it can
+void requestDatabaseRefresh(void)
+{
+    sem_post(g_refresh_database_request);
+}
+
 static void interrupt_handler(int signum)
 {
     if (!g_connected)
@@ -1133,6 +1326,43 @@ static void interrupt_handler(int signum)
     }
 }
 
+static void sigusr1_handler(int signum)
+{
+    // the database thread prints them, nothing here can take a lock
+    if (!g_stats_request)
+    {
+        g_stats_request = 1;
+        sem_post(g_refresh_database_request);
+    }
+}
+
+static void printDatabaseStats(void)
+{
+    static const char *names[DATABASE_NUM_ROOTS] =
+    {
+        "Photos", "Videos", "Music", "Vita apps", "PSP apps", "PSP saves", "PSX apps", "PSM apps", "Backups"
+    };
+    struct cma_stats stats;
+    int objects = 0;
+    int i;
+
+    getDatabaseStats(&stats);
+
+    for (i = 0; i < DATABASE_NUM_ROOTS; i++)
+    {
+        LOG(LINFO, "%-10s %8d objects, %d folders\n", names[i], stats.objects[i], stats.folders[i]);
+        objects += stats.objects[i];
+    }
+
+    LOG(LINFO, "%d objects, built in %.2f seconds at %s", objects, stats.build_seconds, ctime(&stats.build_time));
+    LOG(LINFO, "Memory: %zu KB objects, %zu KB strings, %zu KB filters, %zu KB tables, %zu KB XML, %zu KB arena\n",
+        stats.object_bytes / 1024, stats.string_bytes / 1024, stats.filter_bytes / 1024, stats.table_bytes / 1024,
+        stats.xml_bytes / 1024, stats.arena_bytes / 1024);
+    LOG(LINFO, "Lookups: %lu by OHFI, %lu by path, %lu names with %lu probes\n",
+        stats.ohfi_lookups, stats.path_lookups, stats.name_lookups, stats.name_probes);
+    LOG(LINFO, "Listings: %lu walked, %lu cached\n", stats.listings, stats.cached_listings);
+}
+
 static void sigtstp_handler(int signum)
 {
     if (!g_connected)
@@ -1153,6 +1383,8 @@ int main(int argc, char **argv)
     srand((unsigned int)time(NULL));
     /* Parse the command line arguments */
     int wireless = 0;
+    int lazy = 0;
+    int stats = 0;
 
     // Start with some default values
     char cwd[FILENAME_MAX];
@@ -1163,6 +1395,7 @@ int main(int argc, char **argv)
     g_paths.videosPath = NULL;
     g_paths.musicPath = NULL;
     g_paths.appsPath = NULL;
+    g_paths.cachePath = NULL;
 
     if (argc > 2 && argv[1][0] != '-')
     {
@@ -1189,7 +1422,7 @@ int main(int argc, char **argv)
     int c;
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "u:p:v:m:a:l:hd")) != -1)
+    while ((c = getopt(argc, argv, "u:c:p:v:m:a:l:sShd")) != -1)
     {
         switch (c)
         {
@@ -1197,6 +1430,18 @@ int main(int argc, char **argv)
             g_paths.urlPath = optarg;
             break;
 
+        case 'c': // database cache
+            g_paths.cachePath = optarg;
+            break;
+
+        case 's': // lazy scanning
+            lazy = 1;
+            break;
+
+        case 'S': // statistics
+            stats = 1;
+            break;
+
         case 'p': // photo path
             g_paths.photosPath = optarg;
             break;
@@ -1273,6 +1518,7 @@ int main(int argc, char **argv)
     fprintf(stderr, "%s\nlibVitaMTP Version: %d.%d\nProtocol Max Version: %08d\n",
             OPENCMA_VERSION_STRING, VITAMTP_VERSION_MAJOR, VITAMTP_VERSION_MINOR, VITAMTP_PROTOCOL_MAX_VERSION);
     fprintf(stderr, "Once connected, send SIGTSTP (usually Ctrl+Z) to refresh the database.\n");
+    fprintf(stderr, "Send SIGUSR1 to print database statistics.\n");
 
     /* Set up the database */
     struct sigaction action;
@@ -1294,6 +1540,14 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    action.sa_handler = sigusr1_handler;
+
+    if (sigaction(SIGUSR1, &action, NULL) < 0)      // SIGUSR1 will be used to print statistics
+    {
+        LOG(LERROR, "Cannot install SIGUSR1 handler.\n");
+        return 1;
+    }
+
     if ((g_refresh_database_request = sem_open("/opencma_refresh_db", O_CREAT, 0777, 0)) == SEM_FAILED)
     {
         LOG(LERROR, "Cannot create semaphore for event flag.\n");
@@ -1410,6 +1664,10 @@ int main(int argc, char **argv)
     free_pc_capability_info(pc_capabilities);
 
     // this thread will update the database when needed
+    int rescan = 0;
+    int changed = 0;
+    int loaded = 0;
+
     while (g_connected)
     {
         sem_wait(g_refresh_database_request);
@@ -1419,13 +1677,73 @@ int main(int argc, char **argv)
             break;
         }
 
+        if (g_stats_request)
+        {
+            // a refresh asked for at the same time posted on its own, so it still happens
+            g_stats_request = 0;
+            printDatabaseStats();
+            continue;
+        }
+
         LOG(LINFO, "Refreshing database for user %s (this may take some time)...\n", g_uuid);
         LOG(LDEBUG, "URL Mapping Path: %s\nPhotos Path: %s\nVideos Path: %s\nMusic Path: %s\nApps Path: %s\n",
             g_paths.urlPath, g_paths.photosPath, g_paths.videosPath, g_paths.musicPath, g_paths.appsPath);
-        destroyDatabase();
-        createDatabase(&g_paths, g_uuid);
+
+        // the Vita keeps browsing the old database until the new one is swapped in
+        // only the first database of the session comes from the cache
+        if (!rescan && g_paths.cachePath != NULL && loadDatabase(&g_paths, g_uuid, g_paths.cachePath) == 0)
+        {
+            LOG(LINFO, "Database loaded from %s.\n", g_paths.cachePath);
+            // only the top level directories were checked, the rescan finds anything deeper
+            loaded = 1;
+        }
+        else if (!rescan && lazy)
+        {
+            // the expand thread saves it once it has all been read
+            createLazyDatabase(&g_paths, g_uuid);
+        }
+        else
+        {
+            // the new database is complete, nothing is left to read in the old one
+            stopExpanding();
+            changed = createDatabase(&g_paths, g_uuid);
+
+            if (g_paths.cachePath != NULL)
+            {
+                saveDatabase(g_paths.cachePath);
+            }
+        }
+
+        // start over with the folders of the new database
+        stopWatcher();
+        startWatcher();
+        startExpanding(); // only if something is left to read
+        startTagging(); // keeps going across refreshes, the new database wakes it
+        rescan = 1;
         LOG(LINFO, "Database refreshed.\n");
+
         LOCK_SEMAPHORE(g_refresh_database_request);  // in case multiple requests were made
+
+        // a request for statistics may have been taken with the others
+        if (stats || g_stats_request)
+        {
+            g_stats_request = 0;
+            printDatabaseStats();
+        }
+
+        if (changed)
+        {
+            // whatever changed while we were scanning may have been missed
+            LOG(LINFO, "Files changed during the refresh, refreshing again.\n");
+            sem_post(g_refresh_database_request);
+            changed = 0;
+        }
+        else if (loaded)
+        {
+            LOG(LINFO, "Rescanning in the background to catch up with the cached database.\n");
+            sem_post(g_refresh_database_request);
+            loaded = 0;
+        }
     }
 
     LOG(LINFO, "Shutting down...\n");
@@ -1435,6 +1753,16 @@ int main(int argc, char **argv)
 
     // Clean up our mess
     VitaMTP_Release_Device(device);
+    stopExpanding();
+    stopTagging();
+    stopWatcher();
+
+    // keep what the watcher picked up for next time
+    if (g_database != NULL && g_paths.cachePath != NULL)
+    {
+        saveDatabase(g_paths.cachePath);
+    }
+
     destroyDatabase();
     sem_close(g_refresh_database_request);
     sem_unlink("/opencma_refresh_db");
@@ -20,6 +20,9 @@
 #ifndef VitaMTP_opencma_h
 #define VitaMTP_opencma_h
 
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
 #include <vitamtp.h>
 
 // forward reference
@@ -45,12 +48,141 @@ extern unsigned int g_log_level;
 struct cma_object
 {
     metadata_t metadata;
-    struct cma_object *next_object;
-    char *path; // path of the object
+    struct cma_object *parent;
+    struct cma_object *first_child; // children are sorted by name
+    struct cma_object *last_child;
+    struct cma_object *next_sibling;
+    struct cma_object *prev_sibling; // so an object can be taken out without looking through its siblings
+    struct cma_object *next_name; // chain in the path lookup table
+    char *root_path; // only master objects keep a path, see objectPath()
     int num_filters;
+    unsigned char flags; // OBJECT_UNEXPANDED and OBJECT_INCOMPLETE, only set when scanning lazily
+    unsigned char category; // index of the master object it is under, see lockObject()
+    int column; // where it is in the column of its category
+    unsigned int print; // hash of the first bytes of an app file, 0 until findByContent() reads it
     metadata_t *filters;
+    struct cma_song *song; // only for music files, see indexSong()
+    struct cma_group *month; // the month a photo or video is listed in, see indexMonth()
+    struct cma_object *next_print; // chain in the content table
 };
 
+// folders that createLazyDatabase() has not read yet
+#define OBJECT_UNEXPANDED 1 // the children are not in the database, the size is 0
+#define OBJECT_INCOMPLETE 2 // something under the folder is unexpanded, so the size is too small
+
+// used to add a batch of objects under the same parent
+struct cma_entry
+{
+    char *name;
+    size_t size;
+    enum DataType type;
+    time_t time; // last modified, taken as when a photo or video was made
+    struct cma_object *object; // filled in by addEntriesToDatabase()
+};
+
+// the result of filterObjects(), owned by the caller so the objects themselves are never touched
+// the metadata is only good while the category of the parent is locked
+struct cma_list
+{
+    const metadata_t **items;
+    int count;
+    int capacity;
+};
+
+// a listing kept for the next request, see filterObjects()
+struct cma_result
+{
+    int ohfiParent;
+    int type; // the filter it was listed with
+    unsigned int generation; // of the database when it was listed
+    struct cma_list list;
+};
+
+// the type of every object in a category side by side, so a filter is a scan instead of a walk of the tree
+// objects are in the order they were added, see selectObjects()
+struct cma_column
+{
+    unsigned int *types; // dataType, 0 where an object was removed
+    struct cma_object **objects;
+    int count;
+    int capacity;
+    int holes; // removed objects still taking space
+};
+
+// objects the Vita can browse by something other than folders, listed like a folder under a filter
+// artists hold albums, albums and genres hold songs and a playlist is read from its file when listed
+// a month holds the photos or videos made in it
+struct cma_group
+{
+    metadata_t metadata; // a Folder with the view it is in as its type
+    const char *key; // the artist, album, genre or month
+    struct cma_object *root; // the master object it is listed under
+    struct cma_group *owner; // the artist of an album, or the view of anything else
+    struct cma_group *first_member; // albums of an artist, or the groups in a view sorted by key
+    struct cma_group *last_member;
+    struct cma_group *next_member;
+    struct cma_group *prev_member;
+    struct cma_song *first_song;
+    struct cma_song *last_song;
+    struct cma_object *playlist; // the file a playlist is read from
+    struct cma_object **objects; // in a month, sorted by time
+    int capacity;
+    struct cma_group *next_key; // chains in the group tables
+    struct cma_group *next_ohfi;
+    int count; // members or songs, the group is removed once it has none
+};
+
+// where a music file is in the groups, linked into its album and its genre
+#define SONG_ALBUM 0
+#define SONG_GENRE 1
+
+struct cma_song
+{
+    struct cma_object *object;
+    const char *genre; // not part of the metadata the Vita gets
+    int tagged; // its tags have been read, see setTags()
+    struct cma_group *groups[2];
+    struct cma_song *next[2];
+    struct cma_song *prev[2];
+};
+
+// what readTags() finds in a music file, anything it does not find is left empty
+struct cma_tags
+{
+    char title[256];
+    char artist[256];
+    char album[256];
+    char genre[256];
+    int codecType; // 0 if it is not one the Vita knows, only codec types of the protocol go out
+    int bitrate; // in bits per second, 0 if it is not known
+};
+
+// a file received in parts that its folders do not count yet, see growObject()
+struct cma_growth
+{
+    int ohfi;
+    unsigned long size; // not added to the folders above it
+};
+
+// everything in a database is allocated from its arena and released together
+struct cma_arena
+{
+    char *next; // free space in the current block
+    char *end;
+    void *blocks;
+    size_t size; // taken from malloc so far
+};
+
+// recycles fixed size allocations from an arena
+struct cma_slab
+{
+    size_t size;
+    void *free_list;
+};
+
+// number of master objects at the start of struct cma_database
+#define DATABASE_NUM_ROOTS 9
+
 struct cma_database
 {
     struct cma_object photos;
@@ -62,6 +194,72 @@ struct cma_database
     struct cma_object psxApps;
     struct cma_object psmApps;
     struct cma_object backups;
+    // the master objects above must come first, anything below is bookkeeping
+    pthread_mutex_t category_locks[DATABASE_NUM_ROOTS]; // one for each master object and everything under it
+    pthread_mutex_t table_lock; // for the tables and the arena, nothing else is locked while it is held
+    int readers; // threads that have it pinned, it is only freed once this drops to zero
+    unsigned int generation; // bumped by every change to the tree
+    unsigned int changes; // only bumped by changes made on disk, see publishDatabase()
+    struct timespec build_start; // for the stats
+    double build_seconds;
+    time_t build_time;
+    struct cma_database *previous; // the published database while this one is being built
+    unsigned int previous_changes;
+    struct cma_object **ohfi_table; // indexed by OHFI, filters point to their owner, read without locking
+    struct cma_xml **xml_table; // indexed by OHFI too, see metadataElement()
+    struct cma_result results[DATABASE_NUM_ROOTS]; // the last listing in each category
+    struct cma_column columns[DATABASE_NUM_ROOTS]; // everything under each master object
+    struct cma_group artists; // the groups under each music filter, albums are under their artist
+    struct cma_group genres;
+    struct cma_group playlists;
+    struct cma_group photo_months;
+    struct cma_group video_months;
+    struct cma_group **group_table; // keyed by owner and key, see findGroup()
+    struct cma_group **group_ohfi_table; // keyed by OHFI, groups are registered to the music object like filters
+    int group_table_size;
+    int group_count;
+    int *untagged; // OHFIs of music files whose tags are still to be read, see nextUntagged()
+    int untagged_head;
+    int untagged_count;
+    int untagged_capacity;
+    struct cma_growth growing[DATABASE_NUM_ROOTS]; // the file being received in each category
+    int ohfi_table_size;
+    struct cma_object **name_table; // keyed by parent OHFI and name, see pathToObject()
+    int name_table_size;
+    int name_count;
+    struct cma_object **print_table; // app, save and backup files keyed by size, see findByContent()
+    int print_table_size;
+    int print_count;
+    char **intern_table; // every distinct name and metadata string, stored once
+    int intern_table_size;
+    int intern_count;
+    struct cma_arena arena;
+    struct cma_slab object_slab;
+    struct cma_slab track_slab;
+    struct cma_slab group_slab;
+    struct cma_slab song_slab;
+};
+
+// what the database holds and how it has been used, filled in by getDatabaseStats()
+struct cma_stats
+{
+    int objects[DATABASE_NUM_ROOTS]; // files and folders under each master object
+    int folders[DATABASE_NUM_ROOTS];
+    size_t object_bytes; // objects and their tracks
+    size_t string_bytes; // names and metadata strings, each stored once
+    size_t filter_bytes;
+    size_t table_bytes; // the OHFI, name and string tables, columns and cached listings
+    size_t xml_bytes; // cached XML
+    size_t arena_bytes; // everything the arena has taken, objects and strings are part of it
+    time_t build_time; // when the database was published
+    double build_seconds; // how long it took to build or load
+    // counted since startup, not reset by a refresh
+    unsigned long ohfi_lookups;
+    unsigned long path_lookups;
+    unsigned long name_lookups; // one for each part of a path, and for each object a rebuild adds
+    unsigned long name_probes; // name table entries looked at, ideally close to name_lookups
+    unsigned long listings; // filterObjects() calls that walked the tree
+    unsigned long cached_listings; // and the ones answered from the last listing
 };
 
 struct cma_paths
@@ -71,6 +269,7 @@ struct cma_paths
     const char *videosPath;
     const char *musicPath;
     const char *appsPath;
+    const char *cachePath;
 };
 
 typedef void (*vita_event_process_t)(vita_device_t *,vita_event_t *,int);
@@ -91,7 +290,7 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
 void vitaEventGetPartOfObject(vita_device_t *device, vita_event_t *event, int eventId);
 void vitaEventSendStorageSize(vita_device_t *device, vita_event_t *event, int eventId);
 void vitaEventCheckExistance(vita_device_t *device, vita_event_t *event, int eventId);
-uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, struct cma_object *parent, uint32_t handle);
+uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, int ohfiParent, uint32_t *handles, unsigned int count);
 void vitaEventGetTreatObject(vita_device_t *device, vita_event_t *event, int eventId);
 void vitaEventSendCopyConfirmationInfo(vita_device_t *device, vita_event_t *event, int eventId);
 void vitaEventSendObjectMetadataItems(vita_device_t *device, vita_event_t *event, int eventId);
@@ -100,20 +299,81 @@ void vitaEventRequestTerminate(vita_device_t *device, vita_event_t *event, int e
 void vitaEventUnimplementated(vita_device_t *device, vita_event_t *event, int eventId);
 
 void *vitaEventListener(vita_device_t *device);
+void requestDatabaseRefresh(void);
 
 /* Database functions */
-void createDatabase(struct cma_paths *paths, const char *uuid);
+void createEmptyDatabase(struct cma_paths *paths, const char *uuid);
+int createDatabase(struct cma_paths *paths, const char *uuid);
+int publishDatabase(void);
+void discardDatabase(void);
 void destroyDatabase(void);
+struct cma_database *currentDatabase(void);
 void lockDatabase(void);
 void unlockDatabase(void);
-void addEntriesForDirectory(struct cma_object *current, int parent_ohfi);
-struct cma_object *addToDatabase(struct cma_object *root, const char *name, size_t size, const enum DataType type);
+struct cma_object *lockObject(int ohfi);
+void unlockObject(const struct cma_object *object);
+void lockCategory(const struct cma_object *object);
+void unlockCategory(const struct cma_object *object);
+struct cma_object *lockRoot(int index);
+void addEntriesForDirectory(struct cma_object *current);
+struct cma_object *addToDatabase(struct cma_object *root, const char *name, size_t size, const enum DataType type,
+                                 time_t time);
+int addEntriesToDatabase(struct cma_object *parent, struct cma_entry *entries, int count);
 void createFilter(struct cma_object *dirobject, metadata_t *output, const char *name, int type);
-void removeFromDatabase(int ohfi, struct cma_object *start);
-void renameRootEntry(struct cma_object *object, const char *name, const char *newname);
+void removeFromDatabase(int ohfi);
+void renameRootEntry(struct cma_object *object, const char *newname);
+int moveObject(struct cma_object *object, struct cma_object *parent, const char *newname);
+void adjustSize(struct cma_object *object, long long delta);
+void growObject(struct cma_object *object, unsigned long size);
+void setObjectTime(struct cma_object *object, time_t time);
+void countChange(void);
+void setTags(struct cma_object *object, const struct cma_tags *tags);
+int nextUntagged(void);
+void settleSizes(void);
+void getDatabaseStats(struct cma_stats *stats);
 struct cma_object *ohfiToObject(int ohfi);
+char *objectPath(const struct cma_object *object, char *buffer, size_t size);
+char *objectRelativePath(const struct cma_object *object, char *buffer, size_t size);
 struct cma_object *pathToObject(char *path, int ohfiParent);
-int filterObjects(int ohfiParent, metadata_t **p_head);
+int findByContent(unsigned long size, const char *data, unsigned int len);
+struct cma_object *nextInTree(struct cma_object *object, const struct cma_object *top);
+int filterObjects(int ohfiParent, struct cma_list *list);
+void freeList(struct cma_list *list);
+const metadata_element_t *metadataElement(const metadata_t *meta);
+
+/* Arena functions */
+void *arenaAlloc(struct cma_arena *arena, size_t size);
+char *arenaStrdup(struct cma_arena *arena, const char *str);
+char *arenaPrintf(struct cma_arena *arena, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void arenaRelease(struct cma_arena *arena);
+void *slabAlloc(struct cma_arena *arena, struct cma_slab *slab);
+void slabFree(struct cma_slab *slab, void *ptr);
+
+/* Scanner functions */
+int readDirectory(const char *path, struct cma_entry **p_entries);
+void scanDirectories(struct cma_object **objects, int count);
+
+/* Lazy scanning functions */
+void createLazyDatabase(struct cma_paths *paths, const char *uuid);
+void expandObject(struct cma_object *object);
+void completeObject(struct cma_object *object);
+void startExpanding(void);
+void stopExpanding(void);
+
+/* Tag functions */
+int readTags(const char *path, unsigned long size, struct cma_tags *tags);
+void startTagging(void);
+void stopTagging(void);
+void wakeTagging(void);
+
+/* Snapshot functions */
+int loadDatabase(struct cma_paths *paths, const char *uuid, const char *file);
+int saveDatabase(const char *file);
+
+/* Watcher functions */
+int startWatcher(void);
+void stopWatcher(void);
+void watchFolder(struct cma_object *folder);
 
 /* Utility functions */
 int createNewDirectory(const char *path);
@@ -126,6 +386,7 @@ int fileExists(const char *path);
 int getDiskSpace(const char *path, uint64_t *free, uint64_t *total);
 int requestURL(const char *url, unsigned char **p_data, unsigned int *p_len);
 char *strreplace(const char *haystack, const char *find, const char *replace);
+void lowerPriority(void);
 capability_info_t *generate_pc_capability_info(void);
 void free_pc_capability_info(capability_info_t *info);
 
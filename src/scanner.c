@@ -0,0 +1,382 @@
+//
+//  Parallel directory scanner
+//  OpenCMA
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "opencma.h"
+
+// scanning is mostly waiting on stat(), especially on network shares,
+// so we run more threads than there are cores
+#define SCAN_THREADS_PER_CPU 2
+#define SCAN_MAX_THREADS 32
+// big enough for a few hundred entries per read
+#define DIRENT_BUFFER_SIZE 65536
+
+// the contents of one directory, read without touching the database
+struct scan_dir
+{
+    char *path;
+    struct cma_entry *entries;
+    struct scan_dir **subdirs; // subdirs[i] is the scan of entries[i] if it is a folder
+    int count;
+    struct scan_dir *next_queued;
+};
+
+struct scan_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct scan_dir *head;
+    int pending; // directories queued or being read
+};
+
+// gets the type, size and time of an entry without resolving its full path
+static int statEntry(int dirfd, const char *name, unsigned char d_type, struct cma_entry *entry)
+{
+    mode_t mode;
+
+    // folders only count what is in them, so there is nothing to look up
+    if (d_type == DT_DIR)
+    {
+        entry->type = Folder;
+        entry->size = 0;
+        entry->time = 0;
+        return 0;
+    }
+
+#ifdef STATX_SIZE
+    struct statx stx;
+
+    if (statx(dirfd, name, AT_NO_AUTOMOUNT, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) == 0)
+    {
+        mode = stx.stx_mode;
+        entry->size = stx.stx_size;
+        entry->time = stx.stx_mtime.tv_sec;
+    }
+    else
+#endif
+    {
+        struct stat statbuf;
+
+        if (fstatat(dirfd, name, &statbuf, 0) != 0)
+        {
+            return -1;
+        }
+
+        mode = statbuf.st_mode;
+        entry->size = statbuf.st_size;
+        entry->time = statbuf.st_mtime;
+    }
+
+    if (S_ISDIR(mode))
+    {
+        entry->type = Folder;
+        entry->size = 0;
+    }
+    else
+    {
+        entry->type = File;
+    }
+
+    return 0;
+}
+
+static void addEntry(int dirfd, const char *name, unsigned char d_type, struct cma_entry **p_entries,
+                     int *p_count, int *p_capacity)
+{
+    struct cma_entry entry;
+
+    if (name[0] == '.' || statEntry(dirfd, name, d_type, &entry) < 0)
+    {
+        return; // ignore hidden folders and ., .. along with anything we can't stat
+    }
+
+    if (*p_count == *p_capacity)
+    {
+        *p_capacity = *p_capacity ? *p_capacity * 2 : 64;
+        *p_entries = realloc(*p_entries, *p_capacity * sizeof(struct cma_entry));
+    }
+
+    entry.name = strdup(name);
+    entry.object = NULL;
+    (*p_entries)[(*p_count)++] = entry;
+}
+
+#ifdef __linux__
+
+// what getdents64 fills the buffer with
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// reads the entries of a directory, returns the number of entries or -1 if it cannot be opened
+int readDirectory(const char *path, struct cma_entry **p_entries)
+{
+    char buffer[DIRENT_BUFFER_SIZE] __attribute__((aligned(8)));
+    struct linux_dirent64 *entry;
+    struct cma_entry *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    long len;
+    long pos;
+    int fd;
+
+    *p_entries = NULL;
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        return -1;
+    }
+
+    // each call returns as many entries as fit, everything else is relative to fd
+    while ((len = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (pos = 0; pos < len; pos += entry->d_reclen)
+        {
+            entry = (struct linux_dirent64 *)(buffer + pos);
+            addEntry(fd, entry->d_name, entry->d_type, &entries, &count, &capacity);
+        }
+    }
+
+    close(fd);
+    *p_entries = entries;
+    return count;
+}
+
+#else
+
+int readDirectory(const char *path, struct cma_entry **p_entries)
+{
+    DIR *dirp;
+    struct dirent *entry;
+    struct cma_entry *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    *p_entries = NULL;
+
+    if ((dirp = opendir(path)) == NULL)
+    {
+        return -1;
+    }
+
+    while ((entry = readdir(dirp)) != NULL)
+    {
+        addEntry(dirfd(dirp), entry->d_name, entry->d_type, &entries, &count, &capacity);
+    }
+
+    closedir(dirp);
+    *p_entries = entries;
+    return count;
+}
+
+#endif
+
+static struct scan_dir *newScanDir(char *path)
+{
+    struct scan_dir *dir = calloc(1, sizeof(struct scan_dir));
+    dir->path = path;
+    return dir;
+}
+
+static void scanOne(struct scan_queue *queue, struct scan_dir *dir)
+{
+    struct scan_dir *found = NULL;
+    struct scan_dir *last = NULL;
+    int num_found = 0;
+    int i;
+
+    if ((dir->count = readDirectory(dir->path, &dir->entries)) <= 0)
+    {
+        dir->count = 0;
+        return;
+    }
+
+    dir->subdirs = calloc(dir->count, sizeof(struct scan_dir *));
+
+    for (i = 0; i < dir->count; i++)
+    {
+        if (dir->entries[i].type == Folder)
+        {
+            char *path;
+
+            // the folder is left empty, like one that cannot be opened
+            if (asprintf(&path, "%s/%s", dir->path, dir->entries[i].name) < 0)
+            {
+                continue;
+            }
+
+            dir->subdirs[i] = newScanDir(path);
+            dir->subdirs[i]->next_queued = found;
+            found = dir->subdirs[i];
+            last = last ? last : found;
+            num_found++;
+        }
+    }
+
+    if (num_found == 0)
+    {
+        return;
+    }
+
+    // hand out all the subdirectories at once
+    pthread_mutex_lock(&queue->lock);
+    last->next_queued = queue->head;
+    queue->head = found;
+    queue->pending += num_found;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void *scanWorker(void *arg)
+{
+    struct scan_queue *queue = arg;
+    struct scan_dir *dir;
+
+    pthread_mutex_lock(&queue->lock);
+
+    for (;;)
+    {
+        while (queue->head == NULL && queue->pending > 0)
+        {
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        }
+
+        if ((dir = queue->head) == NULL)
+        {
+            break; // everything has been read
+        }
+
+        queue->head = dir->next_queued;
+        pthread_mutex_unlock(&queue->lock);
+        scanOne(queue, dir);
+        pthread_mutex_lock(&queue->lock);
+
+        if (--queue->pending == 0)
+        {
+            pthread_cond_broadcast(&queue->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// adds what was read under object to the database and frees the scan
+static void mergeScan(struct cma_object *object, struct scan_dir *dir)
+{
+    unsigned long totalSize = 0;
+    int i;
+
+    addEntriesToDatabase(object, dir->entries, dir->count);
+
+    for (i = 0; i < dir->count; i++)
+    {
+        if (dir->subdirs[i] != NULL)
+        {
+            mergeScan(dir->entries[i].object, dir->subdirs[i]);
+        }
+
+        totalSize += dir->entries[i].object->metadata.size;
+        free(dir->entries[i].name);
+    }
+
+    object->metadata.size += totalSize;
+    free(dir->entries);
+    free(dir->subdirs);
+    free(dir->path);
+    free(dir);
+}
+
+// reads everything under the objects with a pool of threads, then adds it all to the database
+void scanDirectories(struct cma_object **objects, int count)
+{
+    struct scan_queue queue;
+    struct scan_dir **roots = malloc(count * sizeof(struct scan_dir *));
+    pthread_t threads[SCAN_MAX_THREADS];
+    char path[PATH_MAX];
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN) * SCAN_THREADS_PER_CPU;
+    int started;
+    int i;
+
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+    queue.head = NULL;
+    queue.pending = count;
+
+    for (i = count - 1; i >= 0; i--)
+    {
+        roots[i] = newScanDir(strdup(objectPath(objects[i], path, sizeof(path))));
+        roots[i]->next_queued = queue.head;
+        queue.head = roots[i];
+    }
+
+    if (num_threads > SCAN_MAX_THREADS)
+    {
+        num_threads = SCAN_MAX_THREADS;
+    }
+
+    // this thread is a worker too, so the scan goes on even if none can be started
+    for (started = 0; started < num_threads - 1; started++)
+    {
+        if (pthread_create(&threads[started], NULL, scanWorker, &queue) != 0)
+        {
+            LOG(LVERBOSE, "Scanning with %d threads.\n", started + 1);
+            break;
+        }
+    }
+
+    scanWorker(&queue);
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.lock);
+
+    // only now do we need the database, and only one category at a time
+    for (i = 0; i < count; i++)
+    {
+        lockCategory(objects[i]);
+        mergeScan(objects[i], roots[i]);
+        unlockCategory(objects[i]);
+    }
+
+    free(roots);
+}
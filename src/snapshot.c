@@ -0,0 +1,427 @@
+//
+//  Database snapshots for fast startup
+//  OpenCMA
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "opencma.h"
+
+// The snapshot file is position independent, everything is referenced by
+// offset or index so it can be read straight from mmap. Loading still builds
+// the database from it with addEntriesToDatabase(), what it saves is reading
+// every directory. The layout is:
+//   header
+//   one snapshot_root for each master object
+//   all the snapshot_objects in breadth first order, so the children of an
+//   object are stored together and already sorted by name
+//   string table
+// Only the mtimes of the master directories are checked when loading, a change
+// further down is only found by the rescan that follows, see main().
+#define SNAPSHOT_MAGIC 0x42444d43 // "CMDB", also catches byte order mismatches
+#define SNAPSHOT_VERSION 3
+
+struct snapshot_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_roots;
+    uint32_t num_objects;
+    uint64_t strings_size;
+};
+
+struct snapshot_root
+{
+    uint32_t path; // offset in the string table
+    uint32_t first_child;
+    uint32_t num_children;
+    uint32_t padding;
+    int64_t mtime; // of the directory, used to tell if the snapshot is stale
+    uint64_t size;
+};
+
+struct snapshot_object
+{
+    uint32_t name; // offset in the string table
+    uint32_t type; // Folder or File
+    uint32_t first_child;
+    uint32_t num_children;
+    uint64_t size;
+    int64_t time; // last modified, see newObject()
+};
+
+struct snapshot
+{
+    const struct snapshot_header *header;
+    const struct snapshot_root *roots;
+    const struct snapshot_object *objects;
+    const char *strings;
+    unsigned char *loaded; // for each record, so a bad file cannot put an object under two parents
+};
+
+static int64_t directoryTime(const char *path)
+{
+    struct stat statbuf;
+
+    if (stat(path, &statbuf) != 0)
+    {
+        return 0; // a missing directory is fine as long as it is still missing
+    }
+
+    return (int64_t)statbuf.st_mtime;
+}
+
+static const char *snapshotString(const struct snapshot *snap, uint32_t offset)
+{
+    // the string table is checked to end with a null when it is loaded
+    return offset < snap->header->strings_size ? snap->strings + offset : NULL;
+}
+
+static int loadChildren(const struct snapshot *snap, struct cma_object *parent, uint32_t parent_index,
+                        uint32_t first, uint32_t count)
+{
+    const struct snapshot_object *record;
+    struct cma_entry *entries;
+    uint32_t i;
+    int ret = 0;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // children always come after their parent so a bad file cannot make us loop
+    if (first <= parent_index && parent_index != UINT32_MAX)
+    {
+        return -1;
+    }
+
+    if (first >= snap->header->num_objects || count > snap->header->num_objects - first)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (snap->loaded[first + i])
+        {
+            return -1;
+        }
+
+        snap->loaded[first + i] = 1;
+    }
+
+    entries = calloc(count, sizeof(struct cma_entry));
+
+    for (i = 0; i < count; i++)
+    {
+        record = &snap->objects[first + i];
+
+        if ((entries[i].name = (char *)snapshotString(snap, record->name)) == NULL)
+        {
+            free(entries);
+            return -1;
+        }
+
+        entries[i].size = record->size;
+        entries[i].time = record->time;
+        entries[i].type = record->type & Folder ? Folder : File;
+    }
+
+    addEntriesToDatabase(parent, entries, count);
+
+    for (i = 0; i < count && ret == 0; i++)
+    {
+        record = &snap->objects[first + i];
+
+        if (entries[i].type & Folder)
+        {
+            ret = loadChildren(snap, entries[i].object, first + i, record->first_child, record->num_children);
+        }
+    }
+
+    free(entries);
+    return ret;
+}
+
+// creates the database from a snapshot, fails if the snapshot does not match the paths
+int loadDatabase(struct cma_paths *paths, const char *uuid, const char *file)
+{
+    struct snapshot snap;
+    struct stat statbuf;
+    uint64_t expected;
+    void *data;
+    int valid = 1;
+    int fd;
+    int i;
+
+    if ((fd = open(file, O_RDONLY)) < 0)
+    {
+        LOG(LVERBOSE, "No database snapshot at %s\n", file);
+        return -1;
+    }
+
+    if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t)sizeof(struct snapshot_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        LOG(LERROR, "Cannot map %s\n", file);
+        return -1;
+    }
+
+    snap.header = data;
+    expected = sizeof(struct snapshot_header) + (uint64_t)snap.header->num_roots * sizeof(struct snapshot_root)
+               + (uint64_t)snap.header->num_objects * sizeof(struct snapshot_object) + snap.header->strings_size;
+
+    if (snap.header->magic != SNAPSHOT_MAGIC || snap.header->version != SNAPSHOT_VERSION
+            || snap.header->num_roots != DATABASE_NUM_ROOTS || snap.header->strings_size == 0
+            || expected != (uint64_t)statbuf.st_size)
+    {
+        LOG(LERROR, "Database snapshot %s is invalid, ignoring it.\n", file);
+        munmap(data, statbuf.st_size);
+        return -1;
+    }
+
+    snap.roots = (const struct snapshot_root *)(snap.header + 1);
+    snap.objects = (const struct snapshot_object *)(snap.roots + snap.header->num_roots);
+    snap.strings = (const char *)(snap.objects + snap.header->num_objects);
+
+    if (snap.strings[snap.header->strings_size - 1] != '\0')
+    {
+        LOG(LERROR, "Database snapshot %s is invalid, ignoring it.\n", file);
+        munmap(data, statbuf.st_size);
+        return -1;
+    }
+
+    if ((snap.loaded = calloc(snap.header->num_objects + 1, 1)) == NULL)
+    {
+        munmap(data, statbuf.st_size);
+        return -1;
+    }
+
+    createEmptyDatabase(paths, uuid);
+    lockDatabase();
+    // the database is basically an array of cma_objects, so we'll cast it so
+    struct cma_object *db_objects = (struct cma_object *)currentDatabase();
+
+    // make sure nothing has changed at the top level before trusting it
+    for (i = 0; valid && i < DATABASE_NUM_ROOTS; i++)
+    {
+        const char *path = snapshotString(&snap, snap.roots[i].path);
+
+        if (path == NULL || strcmp(path, db_objects[i].root_path) != 0
+                || snap.roots[i].mtime != directoryTime(db_objects[i].root_path))
+        {
+            LOG(LVERBOSE, "Database snapshot is stale for %s\n", db_objects[i].root_path);
+            valid = 0;
+        }
+    }
+
+    for (i = 0; valid && i < DATABASE_NUM_ROOTS; i++)
+    {
+        if (loadChildren(&snap, &db_objects[i], UINT32_MAX, snap.roots[i].first_child, snap.roots[i].num_children) < 0)
+        {
+            LOG(LERROR, "Database snapshot %s is corrupted, ignoring it.\n", file);
+            valid = 0;
+        }
+
+        db_objects[i].metadata.size = snap.roots[i].size;
+    }
+
+    unlockDatabase();
+    munmap(data, statbuf.st_size);
+    free(snap.loaded);
+
+    if (!valid)
+    {
+        discardDatabase();
+        return -1;
+    }
+
+    publishDatabase();
+
+    LOG(LVERBOSE, "Loaded %u objects from database snapshot %s\n", snap.header->num_objects, file);
+    return 0;
+}
+
+struct snapshot_writer
+{
+    struct snapshot_object *objects;
+    struct cma_object **queue; // the object for each record
+    uint32_t num_objects;
+    uint32_t capacity;
+    char *strings;
+    uint64_t strings_size;
+    uint64_t strings_capacity;
+};
+
+static uint32_t addString(struct snapshot_writer *writer, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    uint64_t offset = writer->strings_size;
+
+    if (writer->strings_size + len > writer->strings_capacity)
+    {
+        while (writer->strings_size + len > writer->strings_capacity)
+        {
+            writer->strings_capacity = writer->strings_capacity ? writer->strings_capacity * 2 : 65536;
+        }
+
+        writer->strings = realloc(writer->strings, writer->strings_capacity);
+    }
+
+    memcpy(writer->strings + offset, str, len);
+    writer->strings_size += len;
+    return (uint32_t)offset;
+}
+
+// queues up the children of object and returns how many there are
+static uint32_t addChildren(struct snapshot_writer *writer, const struct cma_object *object)
+{
+    struct cma_object *child;
+    uint32_t count = 0;
+
+    for (child = object->first_child; child != NULL; child = child->next_sibling, count++)
+    {
+        if (writer->num_objects == writer->capacity)
+        {
+            writer->capacity = writer->capacity ? writer->capacity * 2 : 1024;
+            writer->objects = realloc(writer->objects, writer->capacity * sizeof(struct snapshot_object));
+            writer->queue = realloc(writer->queue, writer->capacity * sizeof(struct cma_object *));
+        }
+
+        writer->objects[writer->num_objects].name = addString(writer, child->metadata.name);
+        writer->objects[writer->num_objects].type = child->metadata.dataType & Folder ? Folder : File;
+        writer->objects[writer->num_objects].size = child->metadata.size;
+        writer->objects[writer->num_objects].time = child->metadata.dateTimeCreated;
+        writer->objects[writer->num_objects].first_child = 0;
+        writer->objects[writer->num_objects].num_children = 0;
+        writer->queue[writer->num_objects] = child;
+        writer->num_objects++;
+    }
+
+    return count;
+}
+
+// writes the database out to file, replacing the old snapshot only once it is complete
+int saveDatabase(const char *file)
+{
+    struct snapshot_writer writer = {0};
+    struct snapshot_header header;
+    struct snapshot_root roots[DATABASE_NUM_ROOTS];
+    char *tmpfile;
+    FILE *fp;
+    uint32_t i;
+    int ret = 0;
+
+    lockDatabase();
+    // the database is basically an array of cma_objects, so we'll cast it so
+    struct cma_object *db_objects = (struct cma_object *)currentDatabase();
+
+    for (i = 0; i < DATABASE_NUM_ROOTS; i++)
+    {
+        // the snapshot has no way to say a folder was not read
+        if (db_objects[i].flags & OBJECT_INCOMPLETE)
+        {
+            unlockDatabase();
+            LOG(LVERBOSE, "Not saving database snapshot, not all folders have been read.\n");
+            return -1;
+        }
+    }
+
+    memset(roots, 0, sizeof(roots));
+
+    for (i = 0; i < DATABASE_NUM_ROOTS; i++)
+    {
+        roots[i].path = addString(&writer, db_objects[i].root_path);
+        roots[i].mtime = directoryTime(db_objects[i].root_path);
+        roots[i].size = db_objects[i].metadata.size;
+        roots[i].first_child = writer.num_objects;
+        roots[i].num_children = addChildren(&writer, &db_objects[i]);
+    }
+
+    // breadth first, the queue grows as we go
+    for (i = 0; i < writer.num_objects; i++)
+    {
+        writer.objects[i].first_child = writer.num_objects;
+        writer.objects[i].num_children = addChildren(&writer, writer.queue[i]);
+    }
+
+    unlockDatabase();
+
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.num_roots = DATABASE_NUM_ROOTS;
+    header.num_objects = writer.num_objects;
+    header.strings_size = writer.strings_size;
+
+    if (asprintf(&tmpfile, "%s.tmp", file) < 0)
+    {
+        LOG(LERROR, "Cannot save database snapshot %s.\n", file);
+        tmpfile = NULL;
+        ret = -1;
+    }
+    else if ((fp = fopen(tmpfile, "wb")) == NULL)
+    {
+        LOG(LERROR, "Cannot open %s for writing.\n", tmpfile);
+        ret = -1;
+    }
+    else
+    {
+        if (fwrite(&header, sizeof(header), 1, fp) != 1
+                || fwrite(roots, sizeof(roots), 1, fp) != 1
+                || fwrite(writer.objects, sizeof(struct snapshot_object), writer.num_objects, fp) != writer.num_objects
+                || fwrite(writer.strings, 1, writer.strings_size, fp) != writer.strings_size)
+        {
+            LOG(LERROR, "Cannot write database snapshot to %s.\n", tmpfile);
+            ret = -1;
+        }
+
+        if (fclose(fp) != 0 || ret < 0 || rename(tmpfile, file) < 0)
+        {
+            LOG(LERROR, "Cannot save database snapshot %s.\n", file);
+            unlink(tmpfile);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        LOG(LVERBOSE, "Saved %u objects to database snapshot %s\n", writer.num_objects, file);
+    }
+
+    free(tmpfile);
+    free(writer.objects);
+    free(writer.queue);
+    free(writer.strings);
+    return ret;
+}
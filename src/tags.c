@@ -0,0 +1,894 @@
+//
+//  Tag reader, music metadata is filled in the background
+//  OpenCMA
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "opencma.h"
+
+// reading tags is mostly waiting on the disk, a few threads keep it busy
+#define TAG_THREADS 4
+// the largest frame or atom we read for a single field, anything bigger is cover art
+#define TAG_FIELD_MAX 4096
+// the most we read of the start of an Ogg file or of a FLAC comment block
+#define TAG_BLOCK_MAX 65536
+// how far into an MPEG file we look for the first frame
+#define MPEG_SEARCH_MAX 4096
+#define MP4_MAX_DEPTH 8
+
+// codec types the Vita knows, music files have the MP3 one until their tags are read
+// there is none for FLAC or Ogg, those keep the one they were given
+#define CODEC_TYPE_MP3 12
+#define CODEC_TYPE_AAC 13
+
+// text encodings, numbered like in ID3v2
+#define ENCODING_LATIN1 0
+#define ENCODING_UTF16 1 // with a byte order mark
+#define ENCODING_UTF16BE 2
+#define ENCODING_UTF8 3
+
+static pthread_t g_tag_threads[TAG_THREADS];
+static int g_tag_started; // only touched by the thread that starts and stops them
+static pthread_mutex_t g_tag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_tag_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int g_tag_wakes; // bumped by wakeTagging(), so a wake up is never missed
+static int g_tag_stop;
+
+// the genres of ID3v1, which ID3v2 and MP4 also refer to by number
+static const char *g_genres[] =
+{
+    "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop", "Jazz", "Metal",
+    "New Age", "Oldies", "Other", "Pop", "R&B", "Rap", "Reggae", "Rock", "Techno", "Industrial",
+    "Alternative", "Ska", "Death Metal", "Pranks", "Soundtrack", "Euro-Techno", "Ambient", "Trip-Hop", "Vocal",
+    "Jazz+Funk", "Fusion", "Trance", "Classical", "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel",
+    "Noise", "AlternRock", "Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop", "Instrumental Rock",
+    "Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+    "Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk", "Jungle",
+    "Native American", "Cabaret", "New Wave", "Psychadelic", "Rave", "Showtunes", "Trailer", "Lo-Fi", "Tribal",
+    "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock"
+};
+
+#define NUM_GENRES (int)(sizeof(g_genres) / sizeof(g_genres[0]))
+
+static inline uint32_t be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint32_t le32(const unsigned char *p)
+{
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+// ID3v2 sizes only use 7 bits of each byte
+static inline uint32_t syncsafe(const unsigned char *p)
+{
+    return (uint32_t)(p[0] & 0x7f) << 21 | (p[1] & 0x7f) << 14 | (p[2] & 0x7f) << 7 | (p[3] & 0x7f);
+}
+
+static int readAt(int fd, void *buffer, size_t len, off_t offset)
+{
+    ssize_t got;
+
+    while (len > 0)
+    {
+        if ((got = pread(fd, buffer, len, offset)) <= 0)
+        {
+            return -1;
+        }
+
+        buffer = (char *)buffer + got;
+        offset += got;
+        len -= got;
+    }
+
+    return 0;
+}
+
+static size_t putUtf8(char *out, size_t pos, unsigned int c)
+{
+    if (c < 0x80)
+    {
+        out[pos++] = c;
+    }
+    else if (c < 0x800)
+    {
+        out[pos++] = 0xc0 | c >> 6;
+        out[pos++] = 0x80 | (c & 0x3f);
+    }
+    else if (c < 0x10000)
+    {
+        out[pos++] = 0xe0 | c >> 12;
+        out[pos++] = 0x80 | (c >> 6 & 0x3f);
+        out[pos++] = 0x80 | (c & 0x3f);
+    }
+    else
+    {
+        out[pos++] = 0xf0 | c >> 18;
+        out[pos++] = 0x80 | (c >> 12 & 0x3f);
+        out[pos++] = 0x80 | (c >> 6 & 0x3f);
+        out[pos++] = 0x80 | (c & 0x3f);
+    }
+
+    return pos;
+}
+
+// copies a string from a tag into a field as UTF-8, the first value found for a field is the one kept
+static void setText(char *field, int encoding, const unsigned char *text, size_t len)
+{
+    size_t size = sizeof(((struct cma_tags *)NULL)->title);
+    int bigEndian = encoding == ENCODING_UTF16BE;
+    unsigned int c;
+    unsigned int low;
+    size_t pos = 0;
+    size_t i = 0;
+
+    if (field[0] != '\0' || encoding > ENCODING_UTF8)
+    {
+        return;
+    }
+
+    if (encoding == ENCODING_UTF16 && len >= 2)
+    {
+        bigEndian = text[0] == 0xfe;
+        i = 2;
+    }
+
+    // room is left for the longest character and the terminator
+    while (i < len && pos + 5 <= size)
+    {
+        if (encoding == ENCODING_LATIN1 || encoding == ENCODING_UTF8)
+        {
+            c = text[i++];
+        }
+        else if (i + 1 < len)
+        {
+            c = bigEndian ? text[i] << 8 | text[i + 1] : text[i + 1] << 8 | text[i];
+            i += 2;
+
+            if (c >= 0xd800 && c < 0xdc00 && i + 1 < len)
+            {
+                low = bigEndian ? text[i] << 8 | text[i + 1] : text[i + 1] << 8 | text[i];
+                c = low >= 0xdc00 && low < 0xe000 ? 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00) : 0xfffd;
+                i += 2;
+            }
+            else if (c >= 0xd800 && c < 0xe000)
+            {
+                c = 0xfffd; // half of a pair
+            }
+        }
+        else
+        {
+            break;
+        }
+
+        if (c == 0)
+        {
+            i = len;
+            break;
+        }
+
+        if (encoding == ENCODING_UTF8)
+        {
+            field[pos++] = c; // copied as it is
+        }
+        else
+        {
+            pos = putUtf8(field, pos, c);
+        }
+    }
+
+    if (encoding == ENCODING_UTF8 && i < len)
+    {
+        // cut short, so the last character may be incomplete
+        while (pos > 0 && (field[pos - 1] & 0xc0) == 0x80)
+        {
+            pos--;
+        }
+
+        pos -= pos > 0 && (field[pos - 1] & 0x80);
+    }
+
+    // ID3v1 pads with spaces
+    while (pos > 0 && field[pos - 1] == ' ')
+    {
+        pos--;
+    }
+
+    field[pos] = '\0';
+}
+
+// ID3v2 genres can be "(17)", "17" or "(17)Rock", the numbers are the ones of ID3v1
+static void setGenre(struct cma_tags *tags, int encoding, const unsigned char *text, size_t len)
+{
+    char *genre = tags->genre;
+    char *end;
+    long index;
+
+    setText(genre, encoding, text, len);
+
+    if (genre[0] == '(' && (index = strtol(genre + 1, &end, 10)) >= 0 && end != genre + 1 && *end == ')')
+    {
+        if (end[1] != '\0')
+        {
+            memmove(genre, end + 1, strlen(end + 1) + 1);
+            return;
+        }
+    }
+    else if ((index = strtol(genre, &end, 10)) < 0 || end == genre || *end != '\0')
+    {
+        return;
+    }
+
+    if (index < NUM_GENRES)
+    {
+        strcpy(genre, g_genres[index]);
+    }
+}
+
+// the fixed block at the end of an MP3, only used for what ID3v2 did not have
+static void readId3v1(int fd, unsigned long size, struct cma_tags *tags)
+{
+    unsigned char tag[128];
+
+    if (size < sizeof(tag) || readAt(fd, tag, sizeof(tag), size - sizeof(tag)) < 0 || memcmp(tag, "TAG", 3) != 0)
+    {
+        return;
+    }
+
+    setText(tags->title, ENCODING_LATIN1, tag + 3, 30);
+    setText(tags->artist, ENCODING_LATIN1, tag + 33, 30);
+    setText(tags->album, ENCODING_LATIN1, tag + 63, 30);
+
+    if (tags->genre[0] == '\0' && tag[127] < NUM_GENRES)
+    {
+        strcpy(tags->genre, g_genres[tag[127]]);
+    }
+}
+
+// reads the text frames we want and skips everything else, returns where the audio starts
+static off_t readId3v2(int fd, struct cma_tags *tags)
+{
+    unsigned char header[10];
+    unsigned char frame[10];
+    unsigned char data[TAG_FIELD_MAX];
+    off_t pos = sizeof(header);
+    off_t end;
+    uint32_t len;
+    int version;
+    int frameSize;
+    int idSize;
+    int skip;
+    char *field;
+
+    if (readAt(fd, header, sizeof(header), 0) < 0 || memcmp(header, "ID3", 3) != 0)
+    {
+        return 0;
+    }
+
+    version = header[3];
+    end = sizeof(header) + syncsafe(header + 6);
+    frameSize = version == 2 ? 6 : 10;
+    idSize = version == 2 ? 3 : 4;
+
+    // unsynchronised tags, and compressed ones in ID3v2.2, are rare enough to leave to ID3v1
+    if (version < 2 || version > 4 || (header[5] & 0x80) || (version == 2 && (header[5] & 0x40)))
+    {
+        return end + (header[5] & 0x10 ? 10 : 0);
+    }
+
+    if (header[5] & 0x40)
+    {
+        // the extended header, its size only counts itself in ID3v2.4
+        if (readAt(fd, frame, 4, pos) < 0)
+        {
+            return end;
+        }
+
+        pos += version == 4 ? syncsafe(frame) : be32(frame) + 4;
+    }
+
+    while (pos + frameSize <= end && readAt(fd, frame, frameSize, pos) == 0 && frame[0] != '\0')
+    {
+        if (version == 2)
+        {
+            len = frame[3] << 16 | frame[4] << 8 | frame[5];
+        }
+        else
+        {
+            len = version == 4 ? syncsafe(frame + 4) : be32(frame + 4);
+        }
+
+        field = NULL;
+
+        // compressed, encrypted, grouped and unsynchronised frames are skipped
+        if (version == 2 || (frame[9] & (version == 4 ? 0x4e : 0xe0)) == 0)
+        {
+            if (memcmp(frame, version == 2 ? "TT2" : "TIT2", idSize) == 0)
+            {
+                field = tags->title;
+            }
+            else if (memcmp(frame, version == 2 ? "TP1" : "TPE1", idSize) == 0)
+            {
+                field = tags->artist;
+            }
+            else if (memcmp(frame, version == 2 ? "TAL" : "TALB", idSize) == 0)
+            {
+                field = tags->album;
+            }
+            else if (memcmp(frame, version == 2 ? "TCO" : "TCON", idSize) == 0)
+            {
+                field = tags->genre;
+            }
+        }
+
+        // the data length indicator of ID3v2.4 comes first
+        skip = version == 4 && (frame[9] & 0x01) ? 4 : 0;
+
+        if (field != NULL && len > (uint32_t)skip + 1 && len <= sizeof(data)
+                && readAt(fd, data, len, pos + frameSize) == 0)
+        {
+            if (field == tags->genre)
+            {
+                setGenre(tags, data[skip], data + skip + 1, len - skip - 1);
+            }
+            else
+            {
+                setText(field, data[skip], data + skip + 1, len - skip - 1);
+            }
+        }
+
+        pos += frameSize + len;
+    }
+
+    return end + (header[5] & 0x10 ? 10 : 0);
+}
+
+// the bitrate of the first MPEG audio frame, which is all of it unless it is VBR
+static void readMpeg(int fd, off_t start, struct cma_tags *tags)
+{
+    static const short bitrates[5][15] =
+    {
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448}, // MPEG-1 layer I
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384}, // MPEG-1 layer II
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}, // MPEG-1 layer III
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256}, // MPEG-2 layer I
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160} // MPEG-2 layers II and III
+    };
+    unsigned char buffer[MPEG_SEARCH_MAX];
+    ssize_t len = pread(fd, buffer, sizeof(buffer), start);
+    int version;
+    int layer;
+    int index;
+    ssize_t i;
+
+    for (i = 0; i + 4 <= len; i++)
+    {
+        if (buffer[i] != 0xff || (buffer[i + 1] & 0xe0) != 0xe0)
+        {
+            continue;
+        }
+
+        version = buffer[i + 1] >> 3 & 3; // 3 is MPEG-1, 1 is reserved
+        layer = buffer[i + 1] >> 1 & 3; // 3 is layer I, 0 is reserved
+        index = buffer[i + 2] >> 4;
+
+        if (version == 1 || layer == 0 || index == 0 || index == 15 || (buffer[i + 2] >> 2 & 3) == 3)
+        {
+            continue;
+        }
+
+        if (version == 3)
+        {
+            tags->bitrate = bitrates[3 - layer][index] * 1000;
+        }
+        else
+        {
+            tags->bitrate = bitrates[layer == 3 ? 3 : 4][index] * 1000;
+        }
+
+        tags->codecType = layer == 1 ? CODEC_TYPE_MP3 : 0;
+        return;
+    }
+}
+
+// Vorbis comments, used by FLAC and Ogg, any part that is cut short is ignored
+static void readComments(const unsigned char *data, size_t len, struct cma_tags *tags)
+{
+    size_t pos;
+    uint32_t count;
+    uint32_t size;
+    const char *text;
+    const char *value;
+
+    if (len < 8 || (pos = 4 + (size_t)le32(data)) + 4 > len)
+    {
+        return;
+    }
+
+    count = le32(data + pos);
+    pos += 4;
+
+    for (; count > 0 && pos + 4 <= len; count--, pos += size)
+    {
+        size = le32(data + pos);
+        pos += 4;
+
+        if (size > len - pos)
+        {
+            break;
+        }
+
+        text = (const char *)data + pos;
+
+        if ((value = memchr(text, '=', size)) == NULL)
+        {
+            continue;
+        }
+
+        value++;
+
+        if (value - text == 6 && strncasecmp(text, "TITLE=", 6) == 0)
+        {
+            setText(tags->title, ENCODING_UTF8, (const unsigned char *)value, size - 6);
+        }
+        else if (value - text == 7 && strncasecmp(text, "ARTIST=", 7) == 0)
+        {
+            setText(tags->artist, ENCODING_UTF8, (const unsigned char *)value, size - 7);
+        }
+        else if (value - text == 6 && strncasecmp(text, "ALBUM=", 6) == 0)
+        {
+            setText(tags->album, ENCODING_UTF8, (const unsigned char *)value, size - 6);
+        }
+        else if (value - text == 6 && strncasecmp(text, "GENRE=", 6) == 0)
+        {
+            setText(tags->genre, ENCODING_UTF8, (const unsigned char *)value, size - 6);
+        }
+    }
+}
+
+// goes through the metadata blocks at the start, the audio is never read
+static void readFlac(int fd, off_t pos, unsigned long size, struct cma_tags *tags)
+{
+    unsigned char block[4];
+    unsigned char info[18];
+    unsigned char *data;
+    uint64_t samples;
+    uint32_t rate;
+    uint32_t len;
+
+    pos += 4; // "fLaC"
+
+    do
+    {
+        if (readAt(fd, block, sizeof(block), pos) < 0)
+        {
+            return;
+        }
+
+        len = block[1] << 16 | block[2] << 8 | block[3];
+
+        if ((block[0] & 0x7f) == 0 && len >= sizeof(info) && readAt(fd, info, sizeof(info), pos + 4) == 0)
+        {
+            // STREAMINFO, the bitrate is worked out from how long it plays
+            rate = info[10] << 12 | info[11] << 4 | info[12] >> 4;
+            samples = (uint64_t)(info[13] & 0x0f) << 32 | be32(info + 14);
+
+            if (rate > 0 && samples > 0)
+            {
+                tags->bitrate = (int)((double)size * 8 * rate / samples);
+            }
+        }
+        else if ((block[0] & 0x7f) == 4 && len <= TAG_BLOCK_MAX && (data = malloc(len)) != NULL)
+        {
+            if (readAt(fd, data, len, pos + 4) == 0)
+            {
+                readComments(data, len, tags);
+            }
+
+            free(data);
+        }
+
+        pos += sizeof(block) + len;
+    }
+    while (!(block[0] & 0x80));
+}
+
+static void readOggPacket(const unsigned char *packet, size_t len, struct cma_tags *tags)
+{
+    if (len >= 24 && memcmp(packet, "\x01vorbis", 7) == 0)
+    {
+        // the nominal bitrate
+        tags->bitrate = (int)le32(packet + 20) > 0 ? (int)le32(packet + 20) : 0;
+    }
+    else if (len >= 7 && memcmp(packet, "\x03vorbis", 7) == 0)
+    {
+        readComments(packet + 7, len - 7, tags);
+    }
+    else if (len >= 8 && memcmp(packet, "OpusTags", 8) == 0)
+    {
+        readComments(packet + 8, len - 8, tags);
+    }
+}
+
+// the first two packets have the stream information and the comments, they are put back together from the pages
+static void readOgg(int fd, struct cma_tags *tags)
+{
+    unsigned char *buffer = malloc(TAG_BLOCK_MAX);
+    unsigned char *packet = malloc(TAG_BLOCK_MAX);
+    ssize_t len = pread(fd, buffer, TAG_BLOCK_MAX, 0);
+    ssize_t pos = 0;
+    ssize_t data;
+    size_t packetLen = 0;
+    int packets = 0;
+    int segments;
+    int lace;
+    int i;
+
+    while (packets < 2 && pos + 27 <= len && memcmp(buffer + pos, "OggS", 4) == 0)
+    {
+        segments = buffer[pos + 26];
+        data = pos + 27 + segments;
+
+        for (i = 0; i < segments && packets < 2 && data <= len; i++)
+        {
+            lace = buffer[pos + 27 + i];
+
+            if (data + lace > len)
+            {
+                break;
+            }
+
+            memcpy(packet + packetLen, buffer + data, lace);
+            packetLen += lace;
+            data += lace;
+
+            // a packet ends with the first segment that is not full
+            if (lace < 255)
+            {
+                readOggPacket(packet, packetLen, tags);
+                packetLen = 0;
+                packets++;
+            }
+        }
+
+        pos = data;
+    }
+
+    // comments that go on past what we read still have the first few
+    if (packets == 1 && packetLen > 0)
+    {
+        readOggPacket(packet, packetLen, tags);
+    }
+
+    free(packet);
+    free(buffer);
+}
+
+// one entry under ilst, its value is in a data atom
+static void readMp4Item(int fd, const unsigned char *type, off_t pos, uint64_t len, struct cma_tags *tags)
+{
+    unsigned char data[TAG_FIELD_MAX];
+    char *field = NULL;
+
+    if (memcmp(type, "\xa9nam", 4) == 0)
+    {
+        field = tags->title;
+    }
+    else if (memcmp(type, "\xa9" "ART", 4) == 0)
+    {
+        field = tags->artist;
+    }
+    else if (memcmp(type, "\xa9" "alb", 4) == 0)
+    {
+        field = tags->album;
+    }
+    else if (memcmp(type, "\xa9gen", 4) == 0 || memcmp(type, "gnre", 4) == 0)
+    {
+        field = tags->genre;
+    }
+
+    // the data atom has a type and a locale before the value
+    if (field == NULL || len < 16 || len > sizeof(data) || readAt(fd, data, len, pos) < 0
+            || memcmp(data + 4, "data", 4) != 0 || be32(data) < 16 || be32(data) > len)
+    {
+        return;
+    }
+
+    len = be32(data);
+
+    if (memcmp(type, "gnre", 4) == 0)
+    {
+        // the ID3v1 number, counted from 1
+        if (len >= 18 && tags->genre[0] == '\0' && data[17] > 0 && data[17] <= NUM_GENRES && data[16] == 0)
+        {
+            strcpy(tags->genre, g_genres[data[17] - 1]);
+        }
+    }
+    else
+    {
+        setText(field, ENCODING_UTF8, data + 16, len - 16);
+    }
+}
+
+// walks the atoms from start to end, going into the ones on the way to the tags and skipping the rest
+static void readAtoms(int fd, off_t start, off_t end, int depth, int items, unsigned long size, struct cma_tags *tags)
+{
+    unsigned char header[16];
+    unsigned char info[32];
+    uint64_t len;
+    uint64_t duration;
+    uint32_t scale;
+    off_t pos;
+    int skip;
+
+    for (pos = start; pos + 8 <= end && depth < MP4_MAX_DEPTH; pos += len)
+    {
+        if (readAt(fd, header, 8, pos) < 0)
+        {
+            return;
+        }
+
+        len = be32(header);
+        skip = 8;
+
+        if (len == 1)
+        {
+            // a 64 bit size follows the type
+            if (readAt(fd, header + 8, 8, pos + 8) < 0)
+            {
+                return;
+            }
+
+            len = (uint64_t)be32(header + 8) << 32 | be32(header + 12);
+            skip = 16;
+        }
+        else if (len == 0)
+        {
+            len = end - pos; // goes to the end of the file
+        }
+
+        if (len < (uint64_t)skip || len > (uint64_t)(end - pos))
+        {
+            return;
+        }
+
+        if (items)
+        {
+            readMp4Item(fd, header + 4, pos + skip, len - skip, tags);
+        }
+        else if (memcmp(header + 4, "moov", 4) == 0 || memcmp(header + 4, "trak", 4) == 0
+                 || memcmp(header + 4, "mdia", 4) == 0 || memcmp(header + 4, "minf", 4) == 0
+                 || memcmp(header + 4, "stbl", 4) == 0 || memcmp(header + 4, "udta", 4) == 0)
+        {
+            readAtoms(fd, pos + skip, pos + len, depth + 1, 0, size, tags);
+        }
+        else if (memcmp(header + 4, "meta", 4) == 0)
+        {
+            // a version and flags come before the atoms in it
+            readAtoms(fd, pos + skip + 4, pos + len, depth + 1, 0, size, tags);
+        }
+        else if (memcmp(header + 4, "ilst", 4) == 0)
+        {
+            readAtoms(fd, pos + skip, pos + len, depth + 1, 1, size, tags);
+        }
+        else if (memcmp(header + 4, "stsd", 4) == 0 && len >= (uint64_t)skip + 16
+                 && readAt(fd, info, 16, pos + skip) == 0 && tags->codecType == 0)
+        {
+            // the format of the first sample description
+            tags->codecType = memcmp(info + 12, "mp4a", 4) == 0 ? CODEC_TYPE_AAC : 0;
+        }
+        else if (memcmp(header + 4, "mvhd", 4) == 0 && len >= (uint64_t)skip + 32
+                 && readAt(fd, info, 32, pos + skip) == 0)
+        {
+            // the bitrate is worked out from how long it plays
+            if (info[0] == 1)
+            {
+                scale = be32(info + 20);
+                duration = (uint64_t)be32(info + 24) << 32 | be32(info + 28);
+            }
+            else
+            {
+                scale = be32(info + 12);
+                duration = be32(info + 16);
+            }
+
+            if (scale > 0 && duration > 0)
+            {
+                tags->bitrate = (int)((double)size * 8 * scale / duration);
+            }
+        }
+    }
+}
+
+// reads what the tags of a music file say, only the parts of the file that hold them are read
+// returns -1 if the file cannot be opened
+int readTags(const char *path, unsigned long size, struct cma_tags *tags)
+{
+    unsigned char magic[12];
+    off_t start;
+    int fd;
+
+    memset(tags, 0, sizeof(struct cma_tags));
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        LOG(LVERBOSE, "Cannot open %s for reading tags.\n", path);
+        return -1;
+    }
+
+    if (readAt(fd, magic, sizeof(magic), 0) < 0)
+    {
+        // too short to have any
+    }
+    else if (memcmp(magic, "fLaC", 4) == 0)
+    {
+        readFlac(fd, 0, size, tags);
+    }
+    else if (memcmp(magic, "OggS", 4) == 0)
+    {
+        readOgg(fd, tags);
+    }
+    else if (memcmp(magic + 4, "ftyp", 4) == 0)
+    {
+        readAtoms(fd, 0, size, 0, 0, size, tags);
+    }
+    else
+    {
+        // some FLAC files have an ID3v2 tag in front too
+        start = readId3v2(fd, tags);
+
+        if (start > 0 && readAt(fd, magic, 4, start) == 0 && memcmp(magic, "fLaC", 4) == 0)
+        {
+            readFlac(fd, start, size, tags);
+        }
+        else
+        {
+            readMpeg(fd, start, tags);
+            readId3v1(fd, size, tags);
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+static void *tagThread(void *arg)
+{
+    char path[PATH_MAX];
+    struct cma_tags tags;
+    struct cma_object *object;
+    unsigned long size = 0;
+    unsigned int wakes;
+    int tried;
+    int ohfi;
+
+    lowerPriority();
+
+    while (!__atomic_load_n(&g_tag_stop, __ATOMIC_SEQ_CST))
+    {
+        // taken before looking, anything queued after that wakes us
+        wakes = __atomic_load_n(&g_tag_wakes, __ATOMIC_SEQ_CST);
+
+        if ((ohfi = nextUntagged()) == 0)
+        {
+            pthread_mutex_lock(&g_tag_lock);
+
+            while (__atomic_load_n(&g_tag_wakes, __ATOMIC_SEQ_CST) == wakes && !__atomic_load_n(&g_tag_stop, __ATOMIC_SEQ_CST))
+            {
+                pthread_cond_wait(&g_tag_cond, &g_tag_lock);
+            }
+
+            pthread_mutex_unlock(&g_tag_lock);
+            continue;
+        }
+
+        // only the path is taken from the database, nothing is locked while the file is read
+        // a file that was still growing is read again once its size stays the same
+        for (tried = 0; (object = lockObject(ohfi)) != NULL; tried = 1)
+        {
+            if (object->metadata.ohfi != ohfi || object->song == NULL || object->song->tagged)
+            {
+                break; // removed, or read by someone else
+            }
+
+            if (tried && object->metadata.size == size)
+            {
+                setTags(object, &tags);
+                break;
+            }
+
+            objectPath(object, path, sizeof(path));
+            size = object->metadata.size;
+            unlockObject(object);
+
+            if (readTags(path, size, &tags) < 0)
+            {
+                object = NULL;
+                break;
+            }
+        }
+
+        unlockObject(object);
+    }
+
+    return NULL;
+}
+
+// called when music is added to the published database, the readers may be waiting for it
+void wakeTagging(void)
+{
+    pthread_mutex_lock(&g_tag_lock);
+    __atomic_add_fetch(&g_tag_wakes, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&g_tag_cond);
+    pthread_mutex_unlock(&g_tag_lock);
+}
+
+// reads the tags of music files in the background, as the files are added, at the lowest priority
+void startTagging(void)
+{
+    int i;
+
+    if (g_tag_started > 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(&g_tag_stop, 0, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < TAG_THREADS; i++)
+    {
+        if (pthread_create(&g_tag_threads[i], NULL, tagThread, NULL) != 0)
+        {
+            LOG(LERROR, "Cannot create thread for reading tags.\n");
+            break;
+        }
+    }
+
+    g_tag_started = i;
+}
+
+// must be called before the database is destroyed
+void stopTagging(void)
+{
+    int i;
+
+    pthread_mutex_lock(&g_tag_lock);
+    __atomic_store_n(&g_tag_stop, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&g_tag_cond);
+    pthread_mutex_unlock(&g_tag_lock);
+
+    for (i = 0; i < g_tag_started; i++)
+    {
+        if (pthread_join(g_tag_threads[i], NULL) != 0)
+        {
+            LOG(LERROR, "Error joining thread for reading tags.\n");
+        }
+    }
+
+    g_tag_started = 0;
+}
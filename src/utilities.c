@@ -30,9 +30,21 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 #include "opencma.h"
 
+#ifdef __linux__
+// from linux/ioprio.h, which is not always installed
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
 extern struct cma_paths g_paths;
 
 // from http://nion.modprobe.de/tmp/mkdir.c
@@ -250,6 +262,18 @@ char *strreplace(const char *haystack, const char *find, const char *replace)
     return newstr;
 }
 
+// for threads that work in the background, so the Vita is never kept waiting on the disk
+void lowerPriority(void)
+{
+#ifdef __linux__
+    struct sched_param param = {0};
+
+    // both only apply to this thread
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+}
+
 capability_info_t *generate_pc_capability_info(void)
 {
     // TODO: Actually generate this based on OpenCMA's capabilities
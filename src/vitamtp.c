@@ -17,8 +17,10 @@
 //  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "ptp.h"
 #include "vitamtp.h"
 
@@ -138,6 +140,31 @@ uint16_t VitaMTP_SendObjectMetadata(vita_device_t *device, uint32_t event_id, me
     return ret;
 }
 
+/**
+ * Sends a list of objects that were already converted to XML, so objects
+ * that are shown many times do not have to be converted every time.
+ *
+ * @param device a pointer to the device.
+ * @param event_id the unique ID sent by the Vita with the event.
+ * @param elements the objects in the order they should be shown.
+ * @param count the number of objects.
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_Data_Metadata_Element_To_XML()
+ */
+uint16_t VitaMTP_SendObjectMetadataElements(vita_device_t *device, uint32_t event_id,
+        const metadata_element_t *const *elements, int count)
+{
+    char *data;
+    int len = 0;
+
+    if (VitaMTP_Data_Metadata_Elements_To_XML(elements, count, &data, &len) != 0)
+        return PTP_RC_GeneralError;
+
+    uint16_t ret = VitaMTP_SendData(device, event_id, PTP_OC_VITA_SendObjectMetadata, (unsigned char *)data, len);
+    free(data);
+    return ret;
+}
+
 /**
  * Sends thumbnail metadata and image data to the device.
  *
@@ -713,7 +740,9 @@ uint16_t VitaMTP_SendObject(vita_device_t *device, uint32_t *p_parenthandle, uin
  * unsigned char* containing the data and *p_len will be
  * the size of the data.
  * meta will contain minimal information. Only name,
- * dataType, size (if file), and handle will be filled.
+ * dataType, size (if file), dateTimeCreated and handle will be filled.
+ * dateTimeCreated is the modification date the device reports,
+ * or 0 if it reports none.
  *
  * @param device a pointer to the device.
  * @param handle the PTP handle of the object to get.
@@ -742,9 +771,30 @@ uint16_t VitaMTP_GetObject(vita_device_t *device, uint32_t handle, metadata_t *m
     }
 
     meta->name = value.str;
+    meta->dateTimeCreated = 0;
+
+    // the date is in local time as "YYYYMMDDThhmmss"
+    if (ptp_mtp_getobjectpropvalue(VitaMTP_Get_PTP_Params(device), handle, PTP_OPC_DateModified, &value,
+                                   PTP_DTC_STR) == PTP_RC_OK)
+    {
+        struct tm tm;
+
+        memset(&tm, 0, sizeof(tm));
+
+        if (value.str != NULL && sscanf(value.str, "%4d%2d%2dT%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                                        &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6)
+        {
+            tm.tm_year -= 1900;
+            tm.tm_mon -= 1;
+            tm.tm_isdst = -1;
+            time_t created = mktime(&tm);
+            meta->dateTimeCreated = created > 0 ? (unsigned long)created : 0;
+        }
+
+        free(value.str);
+    }
 
-    // TODO: Make use of date modified and object format
-    //ptp_mtp_getobjectpropvalue ((PTPParams*)device->params, handle, PTP_OPC_DateModified, &value, PTP_DTC_STR);
+    // TODO: Make use of object format
     if (meta->dataType & Folder)
     {
         uint32_t store = VITA_STORAGE_ID;
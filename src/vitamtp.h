@@ -286,6 +286,21 @@ struct metadata
     struct metadata *next_metadata;
 };
 
+/**
+ * The XML for one object, made by VitaMTP_Data_Metadata_Element_To_XML().
+ * It stays valid for as long as the metadata it was made from does not
+ * change, so it can be kept and sent again. The index of the object is
+ * only filled in when a list is sent.
+ *
+ * @see VitaMTP_SendObjectMetadataElements()
+ */
+struct metadata_element
+{
+    char *data; // not null terminated
+    int len;
+    int index_offset; // where the value of the index attribute is
+};
+
 /**
  * A request from the Vita to obtain metadata
  * for the file named.
@@ -461,6 +476,7 @@ typedef struct initiator_info initiator_info_t;
 typedef struct settings_info settings_info_t;
 typedef struct browse_info browse_info_t;
 typedef struct metadata metadata_t;
+typedef struct metadata_element metadata_element_t;
 typedef struct thumbnail thumbnail_t;
 typedef struct object_status object_status_t;
 typedef struct send_part_init send_part_init_t;
@@ -726,6 +742,8 @@ uint16_t VitaMTP_GetVitaInfo(vita_device_t *device, vita_info_t *info);
 uint16_t VitaMTP_SendNumOfObject(vita_device_t *device, uint32_t event_id, uint32_t num);
 uint16_t VitaMTP_GetBrowseInfo(vita_device_t *device, uint32_t event_id, browse_info_t *info);
 uint16_t VitaMTP_SendObjectMetadata(vita_device_t *device, uint32_t event_id, metadata_t *metas);
+uint16_t VitaMTP_SendObjectMetadataElements(vita_device_t *device, uint32_t event_id,
+        const metadata_element_t *const *elements, int count);
 uint16_t VitaMTP_SendObjectThumb(vita_device_t *device, uint32_t event_id, metadata_t *meta, unsigned char *thumb_data,
                                  uint64_t thumb_len);
 uint16_t VitaMTP_ReportResult(vita_device_t *device, uint32_t event_id, uint16_t result);
@@ -775,6 +793,9 @@ void VitaMTP_Data_Free_Initiator(const initiator_info_t *init_info);
 int VitaMTP_Data_Settings_From_XML(settings_info_t **p_settings_info, const char *raw_data, const int len);
 int VitaMTP_Data_Free_Settings(settings_info_t *settings_info);
 int VitaMTP_Data_Metadata_To_XML(const metadata_t *p_metadata, char **data, int *len);
+int VitaMTP_Data_Metadata_Element_To_XML(const metadata_t *p_metadata, metadata_element_t *element);
+int VitaMTP_Data_Metadata_Elements_To_XML(const metadata_element_t *const *elements, int count, char **data,
+        int *len);
 int VitaMTP_Data_Capability_From_XML(capability_info_t **p_info, const char *data, int len);
 int VitaMTP_Data_Capability_To_XML(const capability_info_t *info, char **p_data, int *p_len);
 int VitaMTP_Data_Free_Capability(capability_info_t *info);
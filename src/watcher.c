@@ -0,0 +1,450 @@
+//
+//  Live database updates from filesystem events
+//  OpenCMA
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+
+#include "opencma.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+#define WATCH_BUFFER_SIZE 65536
+
+static int g_watch_fd = -1;
+static int g_watch_stop[2] = {-1, -1}; // written to when the watcher should exit
+static pthread_t g_watch_thread;
+static int *g_watch_ohfi; // indexed by watch descriptor, 0 if unused
+static int g_watch_size;
+// folders are watched from whichever thread adds them, so the table has its own lock
+static pthread_mutex_t g_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a move out of a directory, kept until we know where it went
+struct pending_move
+{
+    uint32_t cookie;
+    int ohfiParent;
+    char name[NAME_MAX + 1];
+};
+
+// the category of the folder must be locked
+void watchFolder(struct cma_object *folder)
+{
+    char path[PATH_MAX];
+    int wd;
+
+    objectPath(folder, path, sizeof(path));
+    pthread_mutex_lock(&g_watch_lock);
+
+    if (g_watch_fd < 0)
+    {
+        pthread_mutex_unlock(&g_watch_lock);
+        return; // everything is watched when the watcher starts
+    }
+
+    // watching the same directory again gives back the same descriptor
+    if ((wd = inotify_add_watch(g_watch_fd, path, WATCH_MASK)) < 0)
+    {
+        pthread_mutex_unlock(&g_watch_lock);
+
+        if (errno == ENOSPC)
+        {
+            LOG(LERROR, "Out of inotify watches at %s, raise fs.inotify.max_user_watches.\n", path);
+        }
+        else
+        {
+            LOG(LVERBOSE, "Cannot watch %s: %s\n", path, strerror(errno));
+        }
+
+        return;
+    }
+
+    if (wd >= g_watch_size)
+    {
+        int size = g_watch_size ? g_watch_size : 1024;
+
+        while (size <= wd)
+        {
+            size *= 2;
+        }
+
+        g_watch_ohfi = realloc(g_watch_ohfi, size * sizeof(int));
+        memset(&g_watch_ohfi[g_watch_size], 0, (size - g_watch_size) * sizeof(int));
+        g_watch_size = size;
+    }
+
+    g_watch_ohfi[wd] = folder->metadata.ohfi;
+    pthread_mutex_unlock(&g_watch_lock);
+}
+
+// the OHFI of the folder a watch is on, 0 if it is not in use
+static int watchedOhfi(int wd)
+{
+    int ohfi;
+
+    pthread_mutex_lock(&g_watch_lock);
+    ohfi = wd >= 0 && wd < g_watch_size ? g_watch_ohfi[wd] : 0;
+    pthread_mutex_unlock(&g_watch_lock);
+    return ohfi;
+}
+
+static void forgetWatch(int wd, int remove)
+{
+    pthread_mutex_lock(&g_watch_lock);
+
+    if (remove)
+    {
+        inotify_rm_watch(g_watch_fd, wd);
+    }
+
+    g_watch_ohfi[wd] = 0;
+    pthread_mutex_unlock(&g_watch_lock);
+}
+
+static void watchTree(struct cma_object *top)
+{
+    struct cma_object *object;
+
+    for (object = top; object != NULL; object = nextInTree(object, top))
+    {
+        // master objects have no Folder bit
+        if (object == top || (object->metadata.dataType & Folder))
+        {
+            watchFolder(object);
+        }
+    }
+}
+
+// makes the database agree with what is on disk for one entry of parent
+static void syncEntry(struct cma_object *parent, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat statbuf;
+    struct cma_object *object;
+    enum DataType type;
+    int exists;
+
+    if (name[0] == '.')
+    {
+        return; // hidden, same as the scan
+    }
+
+    objectPath(parent, path, sizeof(path));
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s", name);
+    exists = stat(path, &statbuf) == 0;
+    type = exists && S_ISDIR(statbuf.st_mode) ? Folder : File;
+    object = pathToObject((char *)name, parent->metadata.ohfi);
+
+    if (object != NULL && (!exists || !(object->metadata.dataType & type)))
+    {
+        LOG(LVERBOSE, "Removing %s\n", path);
+        removeFromDatabase(object->metadata.ohfi);
+        object = NULL;
+    }
+
+    if (!exists)
+    {
+        return;
+    }
+
+    if (object == NULL)
+    {
+        LOG(LVERBOSE, "Adding %s\n", path);
+        // a file may have been copied with its time
+        object = addToDatabase(parent, name, type == File ? statbuf.st_size : 0, type, statbuf.st_mtime);
+
+        if (type == Folder)
+        {
+            // watch before scanning so nothing created in between is missed
+            watchFolder(object);
+            addEntriesForDirectory(object);
+            watchTree(object);
+            // what the scan found only counts in the folder itself
+            adjustSize(parent, object->metadata.size);
+        }
+    }
+    else if (type == Folder)
+    {
+        watchFolder(object); // folders the Vita created are already in the database
+    }
+    else if (object->metadata.size != (unsigned long)statbuf.st_size)
+    {
+        adjustSize(object, (long long)statbuf.st_size - (long long)object->metadata.size);
+        countChange();
+    }
+}
+
+static void finishMove(struct pending_move *from, int ohfiParent, const char *name)
+{
+    struct cma_object *parent = lockObject(from->ohfiParent);
+    struct cma_object *target = ohfiParent ? ohfiToObject(ohfiParent) : NULL;
+    struct cma_object *object;
+
+    if (parent == NULL || parent->metadata.ohfi != from->ohfiParent)
+    {
+        unlockObject(parent);
+        return;
+    }
+
+    // only one category is locked at a time, so a move out of the category is a remove and an add
+    if (target != NULL && target->category == parent->category)
+    {
+        target = lockObject(ohfiParent); // the same category, so this cannot wait on anyone
+
+        if (target != NULL && target->metadata.ohfi != ohfiParent)
+        {
+            unlockObject(target);
+            target = NULL; // a filter, not a folder
+        }
+    }
+    else
+    {
+        target = NULL;
+    }
+
+    // a move within the category keeps the OHFI, anything else is a remove and an add
+    if (target != NULL && name != NULL && name[0] != '.' && from->name[0] != '.'
+            && (object = pathToObject(from->name, from->ohfiParent)) != NULL
+            && pathToObject((char *)name, ohfiParent) == NULL
+            && moveObject(object, target, name) == 0)
+    {
+        LOG(LVERBOSE, "Moved %s to %s\n", from->name, name);
+    }
+    else
+    {
+        syncEntry(parent, from->name);
+    }
+
+    unlockObject(target);
+    unlockObject(parent);
+}
+
+static void handleEvent(const struct inotify_event *event, struct pending_move *pending, int *p_moving)
+{
+    struct cma_object *parent;
+    int ohfi = watchedOhfi(event->wd);
+
+    // a move is only a rename if the other half comes right after it
+    // either way it is finished before locking anything, the other half can be in another category
+    if (*p_moving)
+    {
+        if ((event->mask & IN_MOVED_TO) && event->cookie == pending->cookie)
+        {
+            finishMove(pending, ohfi, event->name);
+        }
+        else
+        {
+            finishMove(pending, 0, NULL);
+        }
+
+        *p_moving = 0;
+    }
+
+    if (ohfi == 0)
+    {
+        return;
+    }
+
+    if (event->mask & IN_IGNORED)
+    {
+        forgetWatch(event->wd, 0);
+        return;
+    }
+
+    if ((parent = lockObject(ohfi)) == NULL || parent->metadata.ohfi != ohfi)
+    {
+        // the folder is gone from the database
+        unlockObject(parent);
+        forgetWatch(event->wd, 1);
+        return;
+    }
+
+    if (event->len == 0)
+    {
+        // events on the directory itself are seen from its parent
+    }
+    else if (event->mask & IN_MOVED_FROM)
+    {
+        pending->cookie = event->cookie;
+        pending->ohfiParent = ohfi;
+        strncpy(pending->name, event->name, NAME_MAX);
+        pending->name[NAME_MAX] = '\0';
+        *p_moving = 1;
+    }
+    else
+    {
+        syncEntry(parent, event->name);
+    }
+
+    unlockObject(parent);
+}
+
+static void *watcherThread(void *arg)
+{
+    char buffer[WATCH_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2];
+    struct pending_move pending;
+    const struct inotify_event *event;
+    ssize_t len;
+    struct cma_object *root;
+    char *p;
+    int moving = 0;
+    int i;
+
+    for (i = 0; i < DATABASE_NUM_ROOTS && (root = lockRoot(i)) != NULL; i++)
+    {
+        watchTree(root);
+        unlockCategory(root);
+    }
+    LOG(LVERBOSE, "Watching for changes.\n");
+
+    fds[0].fd = g_watch_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = g_watch_stop[0];
+    fds[1].events = POLLIN;
+
+    while (poll(fds, 2, -1) >= 0 || errno == EINTR)
+    {
+        if (fds[1].revents)
+        {
+            break;
+        }
+
+        if (!(fds[0].revents & POLLIN) || (len = read(g_watch_fd, buffer, sizeof(buffer))) <= 0)
+        {
+            continue;
+        }
+
+        for (p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event *)p;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                LOG(LERROR, "Too many changes at once, rescanning everything.\n");
+                requestDatabaseRefresh();
+                continue;
+            }
+
+            handleEvent(event, &pending, &moving);
+        }
+
+        if (moving)
+        {
+            finishMove(&pending, 0, NULL);
+            moving = 0;
+        }
+    }
+
+    return NULL;
+}
+
+// starts keeping the database up to date with the disk, the database must exist
+int startWatcher(void)
+{
+    if (g_watch_fd >= 0)
+    {
+        return 0;
+    }
+
+    // folders read lazily are watched as they are added, see watchFolder()
+    pthread_mutex_lock(&g_watch_lock);
+
+    if ((g_watch_fd = inotify_init()) < 0)
+    {
+        pthread_mutex_unlock(&g_watch_lock);
+        LOG(LERROR, "Cannot initialize inotify: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (pipe(g_watch_stop) < 0)
+    {
+        LOG(LERROR, "Cannot create pipe for watcher.\n");
+        close(g_watch_fd);
+        g_watch_fd = -1;
+        pthread_mutex_unlock(&g_watch_lock);
+        return -1;
+    }
+
+    if (pthread_create(&g_watch_thread, NULL, watcherThread, NULL) != 0)
+    {
+        LOG(LERROR, "Cannot create watcher thread.\n");
+        close(g_watch_stop[0]);
+        close(g_watch_stop[1]);
+        close(g_watch_fd);
+        g_watch_fd = -1;
+        pthread_mutex_unlock(&g_watch_lock);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&g_watch_lock);
+    return 0;
+}
+
+// must be called before the database is destroyed
+void stopWatcher(void)
+{
+    if (g_watch_fd < 0)
+    {
+        return;
+    }
+
+    if (write(g_watch_stop[1], "", 1) < 0 || pthread_join(g_watch_thread, NULL) != 0)
+    {
+        LOG(LERROR, "Error joining watcher thread.\n");
+    }
+
+    pthread_mutex_lock(&g_watch_lock);
+    close(g_watch_stop[0]);
+    close(g_watch_stop[1]);
+    close(g_watch_fd); // removes all the watches
+    g_watch_fd = -1;
+    free(g_watch_ohfi);
+    g_watch_ohfi = NULL;
+    g_watch_size = 0;
+    pthread_mutex_unlock(&g_watch_lock);
+}
+
+#else
+
+int startWatcher(void)
+{
+    LOG(LVERBOSE, "Watching for changes is not supported on this system.\n");
+    return -1;
+}
+
+void stopWatcher(void)
+{
+}
+
+void watchFolder(struct cma_object *folder)
+{
+}
+
+#endif